@@ -1,4 +1,26 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
 #include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "binpkg.h"
 
@@ -40,7 +62,17 @@ Header & Pkg::HeaderMut() &
 	return m_header;
 }
 
+/// \brief Reads the 32-bit file format version at the start of the package.
+/// Must be called before ParseHeader when reading a package produced by Write.
+int32_t Pkg::ParseVersion()
+{
+	int32_t version = 0;
+	m_stream.read( (char*)&version, sizeof( version ) );
+	return version;
+}
+
 /// \brief Reads the stream until an empty Item is found.
+/// The offsets recorded in the stream are kept, since items need not be laid out contiguously (see Split).
 Header Pkg::ParseHeader()
 {
 	Header hdr;
@@ -59,7 +91,7 @@ Header Pkg::ParseHeader()
 		}
 		else
 		{
-			hdr.Add( item );
+			hdr.ItemsMut().push_back( item );
 		}
 	}
 	while ( !empty_item_found );
@@ -97,6 +129,10 @@ void Pkg::Write( const Header & hdr )
 		m_stream.write( (char*)&length, sizeof( length ) );
 		m_stream.write( name.c_str(), name.size() + 1 ); // +1 for null terminator
 	}
+
+	// The header is terminated by an empty item.
+	char empty_item[Item::EMPTY_ITEM_SIZE] = {0};
+	m_stream.write( empty_item, sizeof( empty_item ) );
 }
 
 void Pkg::Write( const Item & item, const char * data, size_t data_length )
@@ -116,24 +152,26 @@ void Pkg::Write()
 {
 	Write( m_header );
 
-	int    index = 0;
-	size_t bytes_read_total = 0;
+	int index = 0;
 
 	for ( const auto & item : m_header.Items() )
 	{
 		std::iostream * stream = m_items_map[ index ];
 		char          buffer[4096] = {0};
+		size_t        bytes_written_total = 0;
 
-		while ( bytes_read_total < item.Size() )
+		m_stream.seekp( item.Offset(), m_stream.beg );
+
+		while ( bytes_written_total < item.Length() )
 		{
-			stream->read( buffer, sizeof( buffer ) );
+			size_t bytes_wanted = std::min( sizeof( buffer ), item.Length() - bytes_written_total );
+			stream->read( buffer, bytes_wanted );
 			size_t bytes_read = stream->gcount();
-			bytes_read_total += bytes_read;
 
 			if ( bytes_read > 0 )
 			{
-				// std::cout << "read " << bytes_read << " from " << item.NameCopy() << std::endl;
-				Write( item, buffer, bytes_read );
+				m_stream.write( buffer, bytes_read );
+				bytes_written_total += bytes_read;
 			}
 			else
 			{
@@ -156,6 +194,16 @@ Header::Header( int32_t version )
 {
 }
 
+/// \brief Creates a header holding \p items, laid out contiguously after the header in a single pass.
+/// Prefer this over repeated calls to Add, which lays out every item again on each call.
+Header::Header( int32_t version, std::vector< Item > items )
+	:
+	m_items( std::move( items ) ),
+	m_version( version )
+{
+	UpdateOffsets();
+}
+
 int32_t Header::Version() const
 {
 	return m_version;
@@ -223,6 +271,23 @@ const Item * Header::Get( int index ) const
 	return &m_items.at( index );
 }
 
+/// \brief Checks that \p items fit within a package when laid out contiguously after their header, as the Header constructor does.
+/// \throws std::runtime_error if the last item would end past what 32-bit offsets can address.
+static void CheckPackageLength( const std::vector< Item > & items, const std::string & path )
+{
+	uint64_t length = Item::EMPTY_ITEM_SIZE + sizeof( int32_t );
+
+	for ( const auto & item : items )
+	{
+		length += item.Size() + item.Length();
+	}
+
+	if ( length > UINT32_MAX )
+	{
+		throw std::runtime_error( "package would exceed 4 GiB: " + path );
+	}
+}
+
 #pragma endregion Header
 
 #pragma region item
@@ -289,3 +354,1834 @@ bool Item::IsEmpty()
 }
 
 #pragma endregion item
+
+#pragma region MemoryStreamBuf
+
+/// \param data The bytes to read from. Must outlive the buffer.
+/// \param data_length The number of bytes available in \p data.
+MemoryStreamBuf::MemoryStreamBuf( const unsigned char * data, size_t data_length )
+{
+	// The get area is never written to, so casting away const is safe.
+	char * begin = const_cast< char * >( reinterpret_cast< const char * >( data ) );
+	setg( begin, begin, begin + data_length );
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekoff( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which )
+{
+	off_type base = 0;
+
+	if ( dir == std::ios_base::cur )
+	{
+		base = gptr() - eback();
+	}
+	else if ( dir == std::ios_base::end )
+	{
+		base = egptr() - eback();
+	}
+	return seekpos( pos_type( base + off ), which );
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekpos( pos_type pos, std::ios_base::openmode which )
+{
+	off_type offset = pos;
+
+	if ( ( which & std::ios_base::in ) == 0 || offset < 0 || offset > egptr() - eback() )
+	{
+		return pos_type( off_type( -1 ) );
+	}
+	setg( eback(), eback() + offset, egptr() );
+	return pos;
+}
+
+#pragma endregion MemoryStreamBuf
+
+#pragma region File
+
+/// \brief Opens \p path for positional I/O.
+/// \param write Whether to create or truncate the file for writing instead of opening it read-only.
+/// \return The OS file handle, or -1 on failure.
+static intptr_t OpenFile( const std::string & path, bool write )
+{
+#ifdef _WIN32
+	HANDLE handle = write ?
+	                CreateFileA( path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr ) :
+	                CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	return ( handle == INVALID_HANDLE_VALUE ) ? -1 : reinterpret_cast< intptr_t >( handle );
+#else
+	return write ? open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 ) : open( path.c_str(), O_RDONLY );
+#endif
+}
+
+static void CloseFile( intptr_t file )
+{
+	if ( file != -1 )
+	{
+#ifdef _WIN32
+		CloseHandle( reinterpret_cast< HANDLE >( file ) );
+#else
+		close( static_cast< int >( file ) );
+#endif
+	}
+}
+
+/// \brief Reads \p length bytes at \p offset without moving any shared file position.
+/// \return The number of bytes read, which is less than \p length only at the end of the file or on an I/O error.
+static size_t ReadAt( intptr_t file, char * buf, size_t length, uint64_t offset )
+{
+	size_t bytes_read_total = 0;
+
+	while ( bytes_read_total < length )
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped = {};
+		uint64_t   file_offset = offset + bytes_read_total;
+		overlapped.Offset = static_cast< DWORD >( file_offset );
+		overlapped.OffsetHigh = static_cast< DWORD >( file_offset >> 32 );
+		DWORD bytes_read = 0;
+
+		if ( !ReadFile( reinterpret_cast< HANDLE >( file ), buf + bytes_read_total,
+		                static_cast< DWORD >( std::min< size_t >( length - bytes_read_total, MAXDWORD ) ), &bytes_read, &overlapped ) )
+		{
+			break;
+		}
+#else
+		ssize_t bytes_read = pread( static_cast< int >( file ), buf + bytes_read_total, length - bytes_read_total,
+		                            static_cast< off_t >( offset + bytes_read_total ) );
+
+		if ( bytes_read < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		else if ( bytes_read < 0 )
+		{
+			break;
+		}
+#endif
+
+		if ( bytes_read == 0 )
+		{
+			break;
+		}
+		bytes_read_total += bytes_read;
+	}
+	return bytes_read_total;
+}
+
+/// \brief Writes \p length bytes at \p offset without moving any shared file position.
+/// \return Whether all bytes were written.
+static bool WriteAt( intptr_t file, const char * data, size_t length, uint64_t offset )
+{
+	size_t bytes_written_total = 0;
+
+	while ( bytes_written_total < length )
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped = {};
+		uint64_t   file_offset = offset + bytes_written_total;
+		overlapped.Offset = static_cast< DWORD >( file_offset );
+		overlapped.OffsetHigh = static_cast< DWORD >( file_offset >> 32 );
+		DWORD bytes_written = 0;
+
+		if ( !WriteFile( reinterpret_cast< HANDLE >( file ), data + bytes_written_total,
+		                 static_cast< DWORD >( std::min< size_t >( length - bytes_written_total, MAXDWORD ) ), &bytes_written, &overlapped ) )
+		{
+			return false;
+		}
+#else
+		ssize_t bytes_written = pwrite( static_cast< int >( file ), data + bytes_written_total, length - bytes_written_total,
+		                                static_cast< off_t >( offset + bytes_written_total ) );
+
+		if ( bytes_written < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		else if ( bytes_written <= 0 )
+		{
+			return false;
+		}
+#endif
+		bytes_written_total += bytes_written;
+	}
+	return true;
+}
+
+/// \brief Copies \p length bytes between files, in kernel space with copy_file_range where available.
+/// \return Whether all bytes were copied.
+static bool CopyRange( intptr_t in, uint64_t in_offset, intptr_t out, uint64_t out_offset, size_t length )
+{
+#ifdef __linux__
+	while ( length > 0 )
+	{
+		off64_t in_pos = static_cast< off64_t >( in_offset );
+		off64_t out_pos = static_cast< off64_t >( out_offset );
+		ssize_t bytes_copied = copy_file_range( static_cast< int >( in ), &in_pos, static_cast< int >( out ), &out_pos, length, 0 );
+
+		if ( bytes_copied < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		else if ( bytes_copied <= 0 )
+		{
+			// Unsupported between these files (e.g. across file systems); fall back to copying through user space.
+			break;
+		}
+		in_offset += bytes_copied;
+		out_offset += bytes_copied;
+		length -= bytes_copied;
+	}
+#endif
+
+	char buffer[64 * 1024];
+
+	while ( length > 0 )
+	{
+		size_t bytes_read = ReadAt( in, buffer, std::min( sizeof( buffer ), length ), in_offset );
+
+		if ( bytes_read == 0 || !WriteAt( out, buffer, bytes_read, out_offset ) )
+		{
+			return false;
+		}
+		in_offset += bytes_read;
+		out_offset += bytes_read;
+		length -= bytes_read;
+	}
+	return true;
+}
+
+static void WriteUInt32( std::ostream & os, uint32_t value )
+{
+	os.write( (char*)&value, sizeof( value ) );
+}
+
+static uint32_t ReadUInt32( const char * data )
+{
+	uint32_t value;
+	std::memcpy( &value, data, sizeof( value ) );
+	return value;
+}
+
+/// \return Whether \p path is relative, on either POSIX or Windows.
+static bool IsRelativePath( const std::string & path )
+{
+	return !path.empty() && path[0] != '/' && path[0] != '\\' && path.find( ':' ) == std::string::npos;
+}
+
+/// \brief Moves the finished file at \p temp_path over \p path, atomically where the platform allows.
+/// \p temp_path is kept on failure, since on Windows it may be the only copy left.
+/// \throws std::runtime_error if \p path cannot be replaced.
+static void ReplaceFile( const std::string & temp_path, const std::string & path )
+{
+#ifdef _WIN32
+	// rename cannot replace an existing file on Windows; elsewhere it replaces the target atomically.
+	std::remove( path.c_str() );
+#endif
+
+	if ( std::rename( temp_path.c_str(), path.c_str() ) != 0 )
+	{
+		throw std::runtime_error( "unable to replace " + path + " with " + temp_path );
+	}
+}
+
+/// Closes an OS file handle when it goes out of scope.
+struct ScopedFile
+{
+	intptr_t Handle;
+
+	~ScopedFile()
+	{
+		CloseFile( Handle );
+	}
+};
+
+#pragma endregion File
+
+#pragma region Reader
+
+/// \brief Opens the package at \p path and parses its header.
+Reader::Reader( const std::string & path )
+	:
+	m_data( nullptr ),
+	m_data_length( 0 ),
+	m_file( -1 )
+{
+	std::fstream stream( path, std::ios::in | std::ios::binary );
+
+	if ( !stream.good() )
+	{
+		throw std::runtime_error( "unable to open package: " + path );
+	}
+	ParseHeader( stream );
+	m_file = OpenFile( path, false );
+
+	if ( m_file == -1 )
+	{
+		throw std::runtime_error( "unable to open package: " + path );
+	}
+
+	// The destructor does not run if the constructor throws, so close what was opened so far.
+	try
+	{
+		OpenVolumes( path );
+	}
+	catch ( ... )
+	{
+		Close();
+		throw;
+	}
+}
+
+/// \brief Parses the header of a package already in memory.
+/// \param data The complete package. Must outlive the reader.
+/// \param data_length The number of bytes in \p data.
+/// \throws std::runtime_error if the package is split across volumes (see Split).
+Reader::Reader( const unsigned char * data, size_t data_length )
+	:
+	m_data( data ),
+	m_data_length( data_length ),
+	m_file( -1 )
+{
+	MemoryStreamBuf buf( data, data_length );
+	std::iostream   stream( &buf );
+	ParseHeader( stream );
+
+	// Volumes are separate files, so a package split across them cannot be read from memory.
+	if ( ItemCount() > 0 && std::strcmp( Get( static_cast< int >( ItemCount() ) - 1 )->Name(), VOLUMES_ITEM_NAME ) == 0 )
+	{
+		throw std::runtime_error( "multi-volume packages can only be read from a file" );
+	}
+}
+
+/// \brief Reads a package embedded with `binpkg --emit-cpp` or `binpkg --emit-object`.
+Reader::Reader( const EmbeddedPkg & pkg )
+	:
+	Reader( pkg.Bytes(), pkg.Size() )
+{
+}
+
+Reader::~Reader()
+{
+	Close();
+}
+
+/// \brief Closes the package file and any additional volumes.
+void Reader::Close()
+{
+	CloseFile( m_file );
+	m_file = -1;
+
+	for ( intptr_t volume : m_volumes )
+	{
+		CloseFile( volume );
+	}
+	m_volumes.clear();
+}
+
+void Reader::ParseHeader( std::iostream & stream )
+{
+	Pkg     pkg( stream );
+	int32_t version = pkg.ParseVersion();
+	m_header = pkg.ParseHeader();
+	m_header.SetVersion( version );
+
+	for ( size_t i = 0; i < m_header.ItemCount(); ++i )
+	{
+		// If names repeat, the last item wins.
+		m_names[m_header.Items()[i].NameCopy()] = static_cast< int >( i );
+	}
+}
+
+/// \brief Opens the additional volumes of a package written by Split, as listed in its VOLUMES_ITEM_NAME item.
+/// Relative volume paths are resolved against the directory of the package at \p path.
+void Reader::OpenVolumes( const std::string & path )
+{
+	int index = Find( VOLUMES_ITEM_NAME );
+
+	if ( index == -1 || index != static_cast< int >( ItemCount() ) - 1 )
+	{
+		return;
+	}
+
+	std::vector< char > table( Get( index )->Length() );
+	table.resize( Read( index, 0, table.data(), table.size() ) );
+	size_t              pos = sizeof( uint32_t );
+	uint32_t            volume_count = table.size() >= pos ? ReadUInt32( table.data() ) : 0;
+	size_t              directory_length = path.find_last_of( "/\\" ) + 1;
+
+	for ( uint32_t volume = 1; volume < volume_count; ++volume )
+	{
+		auto end = std::find( table.begin() + std::min( pos, table.size() ), table.end(), '\0' );
+
+		if ( end == table.end() || end == table.begin() + pos )
+		{
+			throw std::runtime_error( "malformed volume table: " + path );
+		}
+
+		std::string volume_path( table.begin() + pos, end );
+		pos += volume_path.size() + 1;
+
+		if ( IsRelativePath( volume_path ) )
+		{
+			volume_path.insert( 0, path, 0, directory_length );
+		}
+		m_volumes.push_back( OpenFile( volume_path, false ) );
+
+		if ( m_volumes.back() == -1 )
+		{
+			throw std::runtime_error( "unable to open volume: " + volume_path );
+		}
+	}
+
+	// The volume of each item, excluding the volume table itself which is always on the first volume.
+	if ( pos > table.size() || table.size() - pos != index * sizeof( uint32_t ) )
+	{
+		throw std::runtime_error( "malformed volume table: " + path );
+	}
+
+	for ( int i = 0; i < index; ++i, pos += sizeof( uint32_t ) )
+	{
+		uint32_t volume = ReadUInt32( table.data() + pos );
+
+		if ( volume >= volume_count )
+		{
+			throw std::runtime_error( "malformed volume table: " + path );
+		}
+		m_item_volumes.push_back( volume );
+	}
+}
+
+/// \return The OS file handle holding the data of the item at \p index.
+intptr_t Reader::FileFor( int index ) const
+{
+	uint32_t volume = static_cast< size_t >( index ) < m_item_volumes.size() ? m_item_volumes[index] : 0;
+	return volume == 0 ? m_file : m_volumes[volume - 1];
+}
+
+const Header & Reader::GetHeader() const
+{
+	return m_header;
+}
+
+size_t Reader::ItemCount() const
+{
+	return m_header.ItemCount();
+}
+
+const Item * Reader::Get( int index ) const
+{
+	return m_header.Get( index );
+}
+
+/// \return The index of the item named \p name, or -1 if no such item exists.
+int Reader::Find( const std::string & name ) const
+{
+	auto itr = m_names.find( name );
+	return itr == m_names.end() ? -1 : itr->second;
+}
+
+/// \brief Reads up to \p buf_length bytes of the item at \p index, starting \p offset bytes into the item.
+/// Safe to call concurrently from multiple threads.
+/// \return The number of bytes read, which is less than \p buf_length only at the end of the item or on an I/O error.
+size_t Reader::Read( int index, size_t offset, char * buf, size_t buf_length ) const
+{
+	const Item * item = Get( index );
+
+	if ( offset >= item->Length() )
+	{
+		return 0;
+	}
+
+	size_t length = std::min( buf_length, static_cast< size_t >( item->Length() ) - offset );
+	size_t position = item->Offset() + offset;
+
+	if ( m_data != nullptr )
+	{
+		length = std::min( length, position < m_data_length ? m_data_length - position : 0 );
+		std::memcpy( buf, m_data + position, length );
+		return length;
+	}
+
+	return ReadAt( FileFor( index ), buf, length, position );
+}
+
+/// \brief Copies \p length bytes of the item at \p index, starting \p offset bytes into the item, to \p file at \p file_offset.
+/// For file-backed packages the copy is done in kernel space where supported, so the data never passes through user space.
+/// Safe to call concurrently from multiple threads.
+/// \param file An OS file handle opened for writing: a file descriptor, or a HANDLE on Windows.
+/// \return Whether all bytes were copied. Fails if the range does not lie within the item.
+bool Reader::Copy( int index, size_t offset, size_t length, intptr_t file, uint64_t file_offset ) const
+{
+	const Item * item = Get( index );
+
+	if ( offset > item->Length() || length > item->Length() - offset )
+	{
+		return false;
+	}
+
+	size_t position = item->Offset() + offset;
+
+	if ( m_data != nullptr )
+	{
+		return position + length <= m_data_length
+		       && WriteAt( file, reinterpret_cast< const char * >( m_data ) + position, length, file_offset );
+	}
+	return CopyRange( FileFor( index ), position, file, file_offset, length );
+}
+
+/// \brief Hints to the OS that the items at \p indexes will be read soon, so it can start reading them in the background.
+void Reader::Prefetch( const std::vector< int > & indexes ) const
+{
+	for ( int index : indexes )
+	{
+		Advise( index, true );
+	}
+}
+
+/// \brief Hints to the OS that the item named \p name will be read soon. Unknown names are ignored.
+void Reader::WillNeed( const std::string & name ) const
+{
+	int index = Find( name );
+
+	if ( index != -1 )
+	{
+		Advise( index, true );
+	}
+}
+
+/// \brief Hints to the OS that the items at \p indexes will not be read soon, so their pages can be dropped.
+void Reader::Drop( const std::vector< int > & indexes ) const
+{
+	for ( int index : indexes )
+	{
+		Advise( index, false );
+	}
+}
+
+/// \brief Hints to the OS that the item named \p name will not be read soon. Unknown names are ignored.
+void Reader::DontNeed( const std::string & name ) const
+{
+	int index = Find( name );
+
+	if ( index != -1 )
+	{
+		Advise( index, false );
+	}
+}
+
+/// \brief Issues a page cache hint for the item at \p index.
+/// Uses posix_fadvise for file-backed packages and madvise for packages in memory.
+/// Hints are best effort and silently ignored where unsupported.
+void Reader::Advise( int index, bool will_need ) const
+{
+	const Item * item = Get( index );
+
+	if ( item->Length() == 0 )
+	{
+		return;
+	}
+
+#ifndef _WIN32
+	if ( m_data == nullptr )
+	{
+		posix_fadvise( static_cast< int >( FileFor( index ) ), item->Offset(), item->Length(),
+		               will_need ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED );
+		return;
+	}
+
+	// madvise requires a page aligned address, so widen the range to whole pages.
+	uintptr_t page_size = static_cast< uintptr_t >( sysconf( _SC_PAGESIZE ) );
+	uintptr_t begin = reinterpret_cast< uintptr_t >( m_data + item->Offset() ) & ~( page_size - 1 );
+	uintptr_t end = reinterpret_cast< uintptr_t >( m_data + item->Offset() + item->Length() );
+
+	if ( will_need )
+	{
+		madvise( reinterpret_cast< void * >( begin ), end - begin, MADV_WILLNEED );
+	}
+#ifdef MADV_COLD
+	else
+	{
+		// MADV_DONTNEED would zero anonymous memory, so only deprioritize the pages instead.
+		madvise( reinterpret_cast< void * >( begin ), end - begin, MADV_COLD );
+	}
+#endif
+#endif
+}
+
+#pragma endregion Reader
+
+#pragma region Overlay
+
+/// \brief Opens each of \p paths, in order from lowest to highest precedence, and merges their indexes.
+/// Shadowed items keep the merged index of the item they replace; new names are appended.
+Overlay::Overlay( const std::vector< std::string > & paths )
+{
+	for ( const auto & path : paths )
+	{
+		m_readers.emplace_back( new Reader( path ) );
+		const Reader & reader = *m_readers.back();
+
+		for ( int i = 0; i < static_cast< int >( reader.ItemCount() ); ++i )
+		{
+			auto result = m_names.emplace( reader.Get( i )->NameCopy(), static_cast< int >( m_entries.size() ) );
+
+			if ( result.second )
+			{
+				m_entries.push_back( Entry{ &reader, i } );
+			}
+			else
+			{
+				m_entries[result.first->second] = Entry{ &reader, i };
+			}
+		}
+	}
+}
+
+/// \return The number of distinct item names across all packages.
+size_t Overlay::ItemCount() const
+{
+	return m_entries.size();
+}
+
+const Item * Overlay::Get( int index ) const
+{
+	const Entry & entry = m_entries.at( index );
+	return entry.Source->Get( entry.Index );
+}
+
+/// \return The merged index of the item named \p name, or -1 if no package contains it.
+int Overlay::Find( const std::string & name ) const
+{
+	auto itr = m_names.find( name );
+	return itr == m_names.end() ? -1 : itr->second;
+}
+
+/// \brief Reads from the package providing the item at merged index \p index. See Reader::Read.
+size_t Overlay::Read( int index, size_t offset, char * buf, size_t buf_length ) const
+{
+	const Entry & entry = m_entries.at( index );
+	return entry.Source->Read( entry.Index, offset, buf, buf_length );
+}
+
+#pragma endregion Overlay
+
+#pragma region ItemCache
+
+/// \param reader The package to read items from. Must outlive the cache.
+/// \param byte_budget The maximum number of item bytes held by the cache, divided evenly between shards.
+/// \param shard_count The number of independently locked shards.
+ItemCache::ItemCache( const Reader & reader, size_t byte_budget, size_t shard_count )
+	:
+	m_reader( reader ),
+	m_shard_budget( byte_budget / std::max< size_t >( shard_count, 1 ) )
+{
+	for ( size_t i = 0; i < std::max< size_t >( shard_count, 1 ); ++i )
+	{
+		m_shards.emplace_back( new Shard() );
+	}
+}
+
+ItemCache::Shard & ItemCache::ShardFor( int index ) const
+{
+	return *m_shards[static_cast< size_t >( index ) % m_shards.size()];
+}
+
+/// \brief Returns the item at \p index, reading it through the Reader on a miss.
+/// Items larger than a shard's budget are returned but never cached.
+ItemCache::Buffer ItemCache::Get( int index )
+{
+	Shard & shard = ShardFor( index );
+	{
+		std::lock_guard< std::mutex > lock( shard.Mutex );
+		auto                          itr = shard.Entries.find( index );
+
+		if ( itr != shard.Entries.end() )
+		{
+			shard.Lru.splice( shard.Lru.begin(), shard.Lru, itr->second.second );
+			shard.Counters.Hits++;
+			return itr->second.first;
+		}
+		shard.Counters.Misses++;
+	}
+
+	// Read without holding the lock so a slow read does not block hits on the same shard.
+	auto data = std::make_shared< std::vector< char > >( m_reader.Get( index )->Length() );
+	data->resize( m_reader.Read( index, 0, data->data(), data->size() ) );
+	Buffer buffer = data;
+
+	if ( buffer->size() > m_shard_budget )
+	{
+		return buffer;
+	}
+
+	std::lock_guard< std::mutex > lock( shard.Mutex );
+	auto                          itr = shard.Entries.find( index );
+
+	if ( itr != shard.Entries.end() )
+	{
+		// Another thread loaded the item in the meantime; share its buffer.
+		return itr->second.first;
+	}
+
+	while ( shard.Bytes + buffer->size() > m_shard_budget )
+	{
+		auto victim = shard.Entries.find( shard.Lru.back() );
+		shard.Bytes -= victim->second.first->size();
+		shard.Entries.erase( victim );
+		shard.Lru.pop_back();
+		shard.Counters.Evictions++;
+	}
+	shard.Lru.push_front( index );
+	shard.Entries.emplace( index, std::make_pair( buffer, shard.Lru.begin() ) );
+	shard.Bytes += buffer->size();
+	return buffer;
+}
+
+/// \return The hit, miss, and eviction counts summed over all shards.
+ItemCache::Stats ItemCache::GetStats() const
+{
+	Stats stats = {};
+
+	for ( const auto & shard : m_shards )
+	{
+		std::lock_guard< std::mutex > lock( shard->Mutex );
+		stats.Hits += shard->Counters.Hits;
+		stats.Misses += shard->Counters.Misses;
+		stats.Evictions += shard->Counters.Evictions;
+	}
+	return stats;
+}
+
+/// \return The number of item bytes currently cached.
+size_t ItemCache::Size() const
+{
+	size_t bytes = 0;
+
+	for ( const auto & shard : m_shards )
+	{
+		std::lock_guard< std::mutex > lock( shard->Mutex );
+		bytes += shard->Bytes;
+	}
+	return bytes;
+}
+
+#pragma endregion ItemCache
+
+#pragma region Delta
+
+/// A patch is itself a package holding one item per item of the new package, with the same names.
+/// Each patch item is a sequence of operations that rebuild the new item:
+///   DELTA_COPY    uint32 old item index, uint32 offset within old item, uint32 length
+///   DELTA_LITERAL uint32 length, followed by length bytes
+static constexpr char DELTA_COPY = 'C';
+static constexpr char DELTA_LITERAL = 'L';
+
+/// Content-defined chunk size bounds. Boundaries are found where the rolling hash has its top 13 bits clear,
+/// giving chunks of around 8 KiB whose boundaries survive insertions and deletions elsewhere in the item.
+static constexpr size_t   CHUNK_MIN_LENGTH = 2 * 1024;
+static constexpr size_t   CHUNK_MAX_LENGTH = 64 * 1024;
+static constexpr uint64_t CHUNK_BOUNDARY_MASK = 0xFFF8000000000000ull;
+
+/// \brief 64-bit FNV-1a.
+/// \param hash The hash of any preceding bytes, for hashing data in pieces.
+static uint64_t HashBytes( const char * data, size_t length, uint64_t hash = 0xCBF29CE484222325ull )
+{
+
+	for ( size_t i = 0; i < length; ++i )
+	{
+		hash = ( hash ^ static_cast< unsigned char >( data[i] ) ) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+/// \brief Splits \p data into content-defined chunks using a gear rolling hash.
+/// \return The length of each chunk, in order.
+static std::vector< size_t > ChunkBytes( const char * data, size_t length )
+{
+	static const std::vector< uint64_t > gear = []()
+	{
+		// splitmix64, so chunk boundaries do not change between builds.
+		std::vector< uint64_t > values( 256 );
+		uint64_t                state = 0;
+
+		for ( auto & value : values )
+		{
+			uint64_t z = ( state += 0x9E3779B97F4A7C15ull );
+			z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+			z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBull;
+			value = z ^ ( z >> 31 );
+		}
+		return values;
+	}();
+	std::vector< size_t > chunks;
+	size_t                start = 0;
+	uint64_t              hash = 0;
+
+	for ( size_t i = 0; i < length; ++i )
+	{
+		hash = ( hash << 1 ) + gear[static_cast< unsigned char >( data[i] )];
+		size_t chunk_length = i + 1 - start;
+
+		if ( ( chunk_length >= CHUNK_MIN_LENGTH && ( hash & CHUNK_BOUNDARY_MASK ) == 0 ) || chunk_length >= CHUNK_MAX_LENGTH )
+		{
+			chunks.push_back( chunk_length );
+			start = i + 1;
+			hash = 0;
+		}
+	}
+
+	if ( start < length )
+	{
+		chunks.push_back( length - start );
+	}
+	return chunks;
+}
+
+/// Encodes delta operations, merging adjacent literals and copies of contiguous old ranges.
+class DeltaEncoder
+{
+public:
+	DeltaEncoder( std::ostream & os )
+		:
+		m_os( os )
+	{
+	}
+
+	void Copy( uint32_t index, uint32_t offset, uint32_t length )
+	{
+		if ( !m_pending_copy || m_index != index || m_offset + m_length != offset )
+		{
+			Flush();
+			m_pending_copy = true;
+			m_index = index;
+			m_offset = offset;
+		}
+		m_length += length;
+	}
+
+	void Literal( const char * data, uint32_t length )
+	{
+		if ( m_pending_copy || m_literal == nullptr || m_literal + m_length != data )
+		{
+			Flush();
+			m_literal = data;
+		}
+		m_length += length;
+	}
+
+	void Flush()
+	{
+		if ( m_pending_copy )
+		{
+			m_os.put( DELTA_COPY );
+			WriteUInt32( m_os, m_index );
+			WriteUInt32( m_os, m_offset );
+			WriteUInt32( m_os, m_length );
+		}
+		else if ( m_literal != nullptr )
+		{
+			m_os.put( DELTA_LITERAL );
+			WriteUInt32( m_os, m_length );
+			m_os.write( m_literal, m_length );
+		}
+		m_pending_copy = false;
+		m_literal = nullptr;
+		m_length = 0;
+	}
+
+protected:
+	std::ostream & m_os;
+	/// Whether the pending operation is a copy rather than a literal.
+	bool           m_pending_copy = false;
+	uint32_t       m_index = 0;
+	uint32_t       m_offset = 0;
+	/// The start of the pending literal, or nullptr if none is pending.
+	const char     * m_literal = nullptr;
+	uint32_t       m_length = 0;
+};
+
+/// \brief Writes a patch to \p patch that rebuilds \p new_pkg from \p old_pkg with Apply.
+/// Items whose content exists anywhere in the old package are copied whole. Other items are split into
+/// content-defined chunks, and chunks found in the old package are copied while the rest are stored in the patch.
+/// Each item's operations are written through to \p patch as they are produced, so \p patch must be seekable.
+/// A trailing BASE_ITEM_NAME item records a hash of each old item, so Apply can detect a different old package.
+void BinPkg::Diff( const Reader & old_pkg, const Reader & new_pkg, std::iostream & patch )
+{
+	struct Location
+	{
+		uint32_t Index;
+		uint32_t Offset;
+		uint32_t Length;
+	};
+
+	std::unordered_multimap< uint64_t, Location > old_items;
+	std::unordered_multimap< uint64_t, Location > old_chunks;
+	std::vector< char >                           buffer;
+	std::vector< char >                           old_buffer;
+	std::vector< uint64_t >                       old_hashes;
+
+	for ( uint32_t i = 0; i < old_pkg.ItemCount(); ++i )
+	{
+		buffer.resize( old_pkg.Get( i )->Length() );
+		buffer.resize( old_pkg.Read( i, 0, buffer.data(), buffer.size() ) );
+		old_hashes.push_back( HashBytes( buffer.data(), buffer.size() ) );
+		old_items.emplace( old_hashes.back(), Location{ i, 0, static_cast< uint32_t >( buffer.size() ) } );
+		uint32_t offset = 0;
+
+		for ( size_t length : ChunkBytes( buffer.data(), buffer.size() ) )
+		{
+			old_chunks.emplace( HashBytes( buffer.data() + offset, length ), Location{ i, offset, static_cast< uint32_t >( length ) } );
+			offset += static_cast< uint32_t >( length );
+		}
+	}
+
+	// Hashes may collide, so candidates are confirmed against the old bytes before being copied.
+	auto find = [&]( const std::unordered_multimap< uint64_t, Location > & locations, const char * data, size_t length ) -> const Location *
+				{
+					auto range = locations.equal_range( HashBytes( data, length ) );
+
+					for ( auto itr = range.first; itr != range.second; ++itr )
+					{
+						old_buffer.resize( length );
+
+						if ( itr->second.Length == length
+						     && old_pkg.Read( itr->second.Index, itr->second.Offset, old_buffer.data(), length ) == length
+						     && std::memcmp( old_buffer.data(), data, length ) == 0 )
+						{
+							return &itr->second;
+						}
+					}
+					return nullptr;
+				};
+
+	// Items are encoded straight into the patch after a placeholder header, which is rewritten once their lengths are known.
+	std::vector< Item > items;
+	std::vector< int >  indexes;
+
+	for ( int i = 0; i < static_cast< int >( new_pkg.ItemCount() ); ++i )
+	{
+		// The volume table describes how the new package was laid out, not its contents.
+		if ( std::strcmp( new_pkg.Get( i )->Name(), VOLUMES_ITEM_NAME ) != 0 )
+		{
+			indexes.push_back( i );
+			items.push_back( Item( new_pkg.Get( i )->Name(), 0, 0 ) );
+		}
+	}
+	items.push_back( Item( BASE_ITEM_NAME, 0, 0 ) );
+	Header hdr( new_pkg.GetHeader().Version(), std::move( items ) );
+	Pkg( patch ).Write( hdr );
+
+	for ( size_t k = 0; k < indexes.size(); ++k )
+	{
+		int          i = indexes[k];
+		auto         start = patch.tellp();
+		DeltaEncoder encoder( patch );
+		buffer.resize( new_pkg.Get( i )->Length() );
+		buffer.resize( new_pkg.Read( i, 0, buffer.data(), buffer.size() ) );
+		const Location * whole = find( old_items, buffer.data(), buffer.size() );
+
+		if ( whole != nullptr )
+		{
+			encoder.Copy( whole->Index, 0, whole->Length );
+		}
+		else
+		{
+			size_t offset = 0;
+
+			for ( size_t length : ChunkBytes( buffer.data(), buffer.size() ) )
+			{
+				const Location * chunk = find( old_chunks, buffer.data() + offset, length );
+
+				if ( chunk != nullptr )
+				{
+					encoder.Copy( chunk->Index, chunk->Offset, chunk->Length );
+				}
+				else
+				{
+					encoder.Literal( buffer.data() + offset, static_cast< uint32_t >( length ) );
+				}
+				offset += length;
+			}
+		}
+		encoder.Flush();
+		hdr.ItemsMut()[k].SetOffset( static_cast< uint32_t >( start ) );
+		hdr.ItemsMut()[k].LengthMut() = static_cast< uint32_t >( patch.tellp() - start );
+	}
+
+	// Record the old package so Apply can refuse to rebuild from a different one.
+	auto start = patch.tellp();
+	WriteUInt32( patch, static_cast< uint32_t >( old_hashes.size() ) );
+	patch.write( reinterpret_cast< const char * >( old_hashes.data() ), old_hashes.size() * sizeof( uint64_t ) );
+	hdr.ItemsMut().back().SetOffset( static_cast< uint32_t >( start ) );
+	hdr.ItemsMut().back().LengthMut() = static_cast< uint32_t >( patch.tellp() - start );
+
+	if ( static_cast< uint64_t >( patch.tellp() ) > UINT32_MAX )
+	{
+		throw std::runtime_error( "patch would exceed 4 GiB" );
+	}
+
+	if ( !patch.seekp( 0 ) )
+	{
+		throw std::runtime_error( "unable to write patch" );
+	}
+	Pkg( patch ).Write( hdr );
+
+	if ( !patch.flush() )
+	{
+		throw std::runtime_error( "unable to write patch" );
+	}
+}
+
+/// A decoded delta operation.
+struct DeltaOp
+{
+	char Type;
+	uint32_t Index;
+	uint32_t Offset;
+	uint32_t Length;
+	/// The number of bytes the operation occupies in the patch, including any literal bytes.
+	size_t Size;
+};
+
+/// \brief Decodes the delta operation at \p pos within patch item \p index, without reading any literal bytes.
+/// \return Whether a complete operation was found.
+static bool ReadDeltaOp( const Reader & patch, int index, size_t pos, DeltaOp & op )
+{
+	char   bytes[13];
+	size_t bytes_read = patch.Read( index, pos, bytes, sizeof( bytes ) );
+
+	if ( bytes_read >= 13 && bytes[0] == DELTA_COPY )
+	{
+		op = DeltaOp{ DELTA_COPY, ReadUInt32( bytes + 1 ), ReadUInt32( bytes + 5 ), ReadUInt32( bytes + 9 ), 13 };
+		return true;
+	}
+	else if ( bytes_read >= 5 && bytes[0] == DELTA_LITERAL )
+	{
+		op = DeltaOp{ DELTA_LITERAL, 0, 0, ReadUInt32( bytes + 1 ), 5 + static_cast< size_t >( ReadUInt32( bytes + 1 ) ) };
+		return pos + op.Size <= patch.Get( index )->Length();
+	}
+	return false;
+}
+
+/// \brief Checks that \p old_pkg is the package \p patch was made from, as recorded in its BASE_ITEM_NAME item at \p base_index.
+/// Only the items in \p copied are hashed, since the others do not affect the result.
+/// \throws std::runtime_error if the old package differs.
+static void CheckBase( const Reader & old_pkg, const Reader & patch, int base_index, const std::vector< bool > & copied )
+{
+	std::vector< char > table( patch.Get( base_index )->Length() );
+	std::vector< char > buffer( 1024 * 1024 );
+
+	if ( table.size() < sizeof( uint32_t )
+	     || patch.Read( base_index, 0, table.data(), table.size() ) != table.size()
+	     || table.size() != sizeof( uint32_t ) + ReadUInt32( table.data() ) * sizeof( uint64_t ) )
+	{
+		throw std::runtime_error( "malformed patch item: " + std::string( BASE_ITEM_NAME ) );
+	}
+
+	if ( ReadUInt32( table.data() ) != old_pkg.ItemCount() )
+	{
+		throw std::runtime_error( "patch was not made from this old package" );
+	}
+
+	for ( int i = 0; i < static_cast< int >( copied.size() ); ++i )
+	{
+		if ( !copied[i] )
+		{
+			continue;
+		}
+
+		uint64_t hash = 0xCBF29CE484222325ull;
+		uint64_t expected;
+		size_t   offset = 0;
+		size_t   bytes_read;
+
+		while ( ( bytes_read = old_pkg.Read( i, offset, buffer.data(), buffer.size() ) ) > 0 )
+		{
+			hash = HashBytes( buffer.data(), bytes_read, hash );
+			offset += bytes_read;
+		}
+		std::memcpy( &expected, table.data() + sizeof( uint32_t ) + i * sizeof( uint64_t ), sizeof( expected ) );
+
+		if ( hash != expected )
+		{
+			throw std::runtime_error( "patch was not made from this old package: " + old_pkg.Get( i )->NameCopy() + " differs" );
+		}
+	}
+}
+
+/// \brief Rebuilds the new package at \p new_path from \p old_pkg and a \p patch written by Diff.
+/// Patch items are processed one at a time without being loaded into memory: unchanged ranges are copied straight
+/// from the old package file and literals straight from the patch file, in kernel space where supported.
+/// The package is written to a temp file beside \p new_path and moved over it once complete, so \p new_path may be the old package.
+/// \throws std::runtime_error if the patch is malformed, does not match \p old_pkg, or \p new_path cannot be written.
+void BinPkg::Apply( const Reader & old_pkg, const Reader & patch, const std::string & new_path )
+{
+	int base_index = patch.Find( BASE_ITEM_NAME );
+
+	if ( base_index == -1 || base_index != static_cast< int >( patch.ItemCount() ) - 1 )
+	{
+		throw std::runtime_error( "patch does not record its old package" );
+	}
+
+	std::vector< Item > items;
+	std::vector< bool > copied( old_pkg.ItemCount(), false );
+	DeltaOp             op;
+
+	// The new item lengths are needed for the header before any data can be placed, so first only scan the operations.
+	for ( int i = 0; i < base_index; ++i )
+	{
+		uint64_t length = 0;
+
+		for ( size_t pos = 0; pos < patch.Get( i )->Length(); pos += op.Size )
+		{
+			if ( !ReadDeltaOp( patch, i, pos, op ) || ( op.Type == DELTA_COPY && op.Index >= old_pkg.ItemCount() ) )
+			{
+				throw std::runtime_error( "malformed patch item: " + patch.Get( i )->NameCopy() );
+			}
+			else if ( op.Type == DELTA_COPY )
+			{
+				copied[op.Index] = true;
+			}
+			length += op.Length;
+		}
+
+		if ( length > UINT32_MAX )
+		{
+			throw std::runtime_error( "patched item too large: " + patch.Get( i )->NameCopy() );
+		}
+		items.push_back( Item( patch.Get( i )->Name(), 0, static_cast< uint32_t >( length ) ) );
+	}
+	CheckBase( old_pkg, patch, base_index, copied );
+	CheckPackageLength( items, new_path );
+
+	Header            hdr( patch.GetHeader().Version(), std::move( items ) );
+	std::stringstream header_stream( std::ios::in | std::ios::out | std::ios::binary );
+	Pkg( header_stream ).Write( hdr );
+	std::string       header_bytes = header_stream.str();
+
+	// Write alongside, since \p new_path may be the old package itself, and a failure must not leave a partial package.
+	std::string temp_path = new_path + ".tmp";
+
+	try
+	{
+		ScopedFile out{ OpenFile( temp_path, true ) };
+
+		if ( out.Handle == -1 || !WriteAt( out.Handle, header_bytes.data(), header_bytes.size(), 0 ) )
+		{
+			throw std::runtime_error( "unable to write package: " + new_path );
+		}
+
+		for ( int i = 0; i < base_index; ++i )
+		{
+			uint64_t out_offset = hdr.Get( i )->Offset();
+
+			for ( size_t pos = 0; pos < patch.Get( i )->Length(); pos += op.Size )
+			{
+				bool ok = ReadDeltaOp( patch, i, pos, op );
+
+				if ( ok && op.Type == DELTA_COPY )
+				{
+					ok = old_pkg.Copy( static_cast< int >( op.Index ), op.Offset, op.Length, out.Handle, out_offset );
+				}
+				else if ( ok )
+				{
+					ok = patch.Copy( i, pos + 5, op.Length, out.Handle, out_offset );
+				}
+
+				if ( !ok )
+				{
+					throw std::runtime_error( "unable to apply patch item: " + patch.Get( i )->NameCopy() );
+				}
+				out_offset += op.Length;
+			}
+		}
+	}
+	catch ( ... )
+	{
+		std::remove( temp_path.c_str() );
+		throw;
+	}
+	ReplaceFile( temp_path, new_path );
+}
+
+#pragma endregion Delta
+
+#pragma region Repack
+
+/// \return The SourceInfo recorded by Repack for each item of \p pkg, indexed like its items,
+/// or an empty vector if \p pkg was not written by Repack.
+std::vector< SourceInfo > BinPkg::ReadSources( const Reader & pkg )
+{
+	std::vector< SourceInfo > sources;
+	int                       index = pkg.Find( SOURCES_ITEM_NAME );
+
+	if ( index == -1 || index != static_cast< int >( pkg.ItemCount() ) - 1 )
+	{
+		return sources;
+	}
+
+	uint32_t count = 0;
+	pkg.Read( index, 0, (char*)&count, sizeof( count ) );
+
+	if ( count != pkg.ItemCount() - 1 || pkg.Get( index )->Length() != sizeof( count ) + count * sizeof( SourceInfo ) )
+	{
+		return sources;
+	}
+	sources.resize( count );
+	pkg.Read( index, sizeof( count ), (char*)sources.data(), count * sizeof( SourceInfo ) );
+	return sources;
+}
+
+/// \brief Hashes the first \p length bytes of \p file with FNV-1a.
+static uint64_t HashFile( intptr_t file, uint64_t length )
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	char     buffer[64 * 1024];
+
+	for ( uint64_t offset = 0; offset < length; )
+	{
+		size_t bytes_read = ReadAt( file, buffer, static_cast< size_t >( std::min< uint64_t >( sizeof( buffer ), length - offset ) ), offset );
+
+		if ( bytes_read == 0 )
+		{
+			break;
+		}
+		hash = HashBytes( buffer, bytes_read, hash );
+		offset += bytes_read;
+	}
+	// 0 means not recorded.
+	return hash == 0 ? 1 : hash;
+}
+
+/// \brief Writes a package of \p files to \p path, reusing the payload of any file unchanged since \p previous was packed.
+/// A file is unchanged if an item of the same name was recorded with the same size and modification time.
+/// With \p hash, content hashes are also recorded, and a file whose modification time changed is still reused
+/// if its hash matches (e.g. after a fresh checkout). Payloads are copied with range copies, in kernel space where supported.
+/// \param previous The package written by the previous run, or nullptr to pack every file.
+/// \throws std::runtime_error if a file cannot be read, the package would exceed 4 GiB, or \p path cannot be written.
+RepackStats BinPkg::Repack( const std::vector< RepackFile > & files, const Reader * previous, const std::string & path, bool hash )
+{
+	std::vector< SourceInfo > previous_sources;
+	std::vector< SourceInfo > sources;
+	std::vector< Item >       items;
+	RepackStats               stats = {};
+
+	if ( previous != nullptr )
+	{
+		previous_sources = ReadSources( *previous );
+	}
+
+	for ( const auto & file : files )
+	{
+		struct stat statinfo;
+
+		if ( stat( file.Path.c_str(), &statinfo ) != 0 || statinfo.st_size > UINT32_MAX )
+		{
+			throw std::runtime_error( "unable to pack file: " + file.Path );
+		}
+#ifdef _WIN32
+		int64_t mtime = static_cast< int64_t >( statinfo.st_mtime ) * 1000000000;
+#else
+		int64_t mtime = static_cast< int64_t >( statinfo.st_mtim.tv_sec ) * 1000000000 + statinfo.st_mtim.tv_nsec;
+#endif
+		sources.push_back( SourceInfo{ static_cast< uint64_t >( statinfo.st_size ), mtime, 0 } );
+		items.push_back( Item( file.Name.c_str(), 0, static_cast< uint32_t >( statinfo.st_size ) ) );
+	}
+
+	uint32_t count = static_cast< uint32_t >( files.size() );
+	items.push_back( Item( SOURCES_ITEM_NAME, 0, static_cast< uint32_t >( sizeof( count ) + count * sizeof( SourceInfo ) ) ) );
+	CheckPackageLength( items, path );
+	Header   hdr( previous != nullptr ? previous->GetHeader().Version() : 0, std::move( items ) );
+
+	std::stringstream header_stream( std::ios::in | std::ios::out | std::ios::binary );
+	Pkg( header_stream ).Write( hdr );
+	std::string       header_bytes = header_stream.str();
+	ScopedFile        out{ OpenFile( path, true ) };
+
+	if ( out.Handle == -1 || !WriteAt( out.Handle, header_bytes.data(), header_bytes.size(), 0 ) )
+	{
+		throw std::runtime_error( "unable to write package: " + path );
+	}
+
+	for ( size_t i = 0; i < files.size(); ++i )
+	{
+		SourceInfo & source = sources[i];
+		ScopedFile   source_file{ -1 };
+		int          previous_index = ( previous != nullptr ) ? previous->Find( files[i].Name ) : -1;
+		bool         reuse = false;
+
+		if ( previous_index != -1 && static_cast< size_t >( previous_index ) < previous_sources.size() )
+		{
+			const SourceInfo & recorded = previous_sources[previous_index];
+			bool               same_size = recorded.Size == source.Size && previous->Get( previous_index )->Length() == source.Size;
+
+			if ( same_size && recorded.MTime == source.MTime && ( !hash || recorded.Hash != 0 ) )
+			{
+				// Trust an unchanged size and modification time without reading the file.
+				source.Hash = recorded.Hash;
+				reuse = true;
+			}
+			else if ( same_size && hash && recorded.Hash != 0 )
+			{
+				source_file.Handle = OpenFile( files[i].Path, false );
+				source.Hash = HashFile( source_file.Handle, source.Size );
+				reuse = source.Hash == recorded.Hash;
+			}
+		}
+
+		uint64_t offset = hdr.Get( static_cast< int >( i ) )->Offset();
+
+		if ( reuse && previous->Copy( previous_index, 0, static_cast< size_t >( source.Size ), out.Handle, offset ) )
+		{
+			stats.Reused++;
+			continue;
+		}
+
+		if ( source_file.Handle == -1 )
+		{
+			source_file.Handle = OpenFile( files[i].Path, false );
+		}
+
+		if ( hash && source.Hash == 0 )
+		{
+			source.Hash = HashFile( source_file.Handle, source.Size );
+		}
+
+		if ( source_file.Handle == -1 || !CopyRange( source_file.Handle, 0, out.Handle, offset, static_cast< size_t >( source.Size ) ) )
+		{
+			throw std::runtime_error( "unable to pack file: " + files[i].Path );
+		}
+		stats.Packed++;
+	}
+
+	std::string sources_bytes( (const char*)&count, sizeof( count ) );
+	sources_bytes.append( (const char*)sources.data(), count * sizeof( SourceInfo ) );
+
+	if ( !WriteAt( out.Handle, sources_bytes.data(), sources_bytes.size(), hdr.Get( static_cast< int >( count ) )->Offset() ) )
+	{
+		throw std::runtime_error( "unable to write package: " + path );
+	}
+	return stats;
+}
+
+#pragma endregion Repack
+
+#pragma region Split
+
+/// \brief Writes a package of \p files spread across several volume files, e.g. one per disk, writing all volumes concurrently.
+/// The first volume holds the header and a VOLUMES_ITEM_NAME item recording the other volume paths and the volume of each item;
+/// Reader opens the other volumes transparently. Items are placed largest first on the least full volume with room,
+/// which balances the bytes written to each volume.
+/// \param volume_paths The volume files. The first is the package to open with Reader.
+/// Relative paths of the others are relative to the directory of the first, and are recorded as given.
+/// \param volume_size The maximum size of each volume in bytes, or 0 for the largest size addressable by an item offset.
+/// \throws std::runtime_error if an item does not fit on any volume, or if a file cannot be read or written.
+void BinPkg::Split( const std::vector< RepackFile > & files, const std::vector< std::string > & volume_paths, uint64_t volume_size )
+{
+	if ( volume_paths.empty() )
+	{
+		throw std::runtime_error( "no volumes to split package across" );
+	}
+
+	uint64_t            limit = ( volume_size == 0 ) ? UINT32_MAX : std::min< uint64_t >( volume_size, UINT32_MAX );
+	std::vector< Item > items;
+	std::stringstream   table( std::ios::in | std::ios::out | std::ios::binary );
+	std::string         directory = volume_paths[0].substr( 0, volume_paths[0].find_last_of( "/\\" ) + 1 );
+
+	for ( const auto & file : files )
+	{
+		struct stat statinfo;
+
+		if ( stat( file.Path.c_str(), &statinfo ) != 0 || statinfo.st_size > UINT32_MAX )
+		{
+			throw std::runtime_error( "unable to pack file: " + file.Path );
+		}
+		items.push_back( Item( file.Name.c_str(), 0, static_cast< uint32_t >( statinfo.st_size ) ) );
+	}
+
+	// The table's length does not depend on the placement of items, so it can be sized up front.
+	WriteUInt32( table, static_cast< uint32_t >( volume_paths.size() ) );
+
+	for ( size_t volume = 1; volume < volume_paths.size(); ++volume )
+	{
+		table << volume_paths[volume] << '\0';
+	}
+	size_t table_length = static_cast< size_t >( table.tellp() ) + files.size() * sizeof( uint32_t );
+	items.push_back( Item( VOLUMES_ITEM_NAME, 0, static_cast< uint32_t >( table_length ) ) );
+	Header hdr( 0, std::move( items ) );
+
+	std::vector< uint64_t > volume_lengths( volume_paths.size(), 0 );
+	std::vector< uint32_t > item_volumes( files.size(), 0 );
+	std::vector< size_t >   order( files.size() );
+	volume_lengths[0] = hdr.CalcSize() + table_length;
+	hdr.ItemsMut().back().SetOffset( static_cast< uint32_t >( hdr.CalcSize() ) );
+
+	for ( size_t i = 0; i < order.size(); ++i )
+	{
+		order[i] = i;
+	}
+	std::stable_sort( order.begin(), order.end(), [&]( size_t lhs, size_t rhs ) { return hdr.Items()[lhs].Length() > hdr.Items()[rhs].Length(); } );
+
+	for ( size_t i : order )
+	{
+		Item   & item = hdr.ItemsMut()[i];
+		size_t volume = std::min_element( volume_lengths.begin(), volume_lengths.end() ) - volume_lengths.begin();
+
+		if ( volume_lengths[volume] + item.Length() > limit )
+		{
+			throw std::runtime_error( "item does not fit on any volume: " + item.NameCopy() );
+		}
+		item.SetOffset( static_cast< uint32_t >( volume_lengths[volume] ) );
+		item_volumes[i] = static_cast< uint32_t >( volume );
+		volume_lengths[volume] += item.Length();
+	}
+
+	for ( uint32_t volume : item_volumes )
+	{
+		WriteUInt32( table, volume );
+	}
+
+	std::vector< std::unique_ptr< ScopedFile > > volumes;
+
+	for ( size_t volume = 0; volume < volume_paths.size(); ++volume )
+	{
+		std::string volume_path = ( volume > 0 && IsRelativePath( volume_paths[volume] ) ) ? directory + volume_paths[volume] : volume_paths[volume];
+		volumes.emplace_back( new ScopedFile{ OpenFile( volume_path, true ) } );
+
+		if ( volumes.back()->Handle == -1 )
+		{
+			throw std::runtime_error( "unable to write volume: " + volume_path );
+		}
+	}
+
+	std::stringstream header_stream( std::ios::in | std::ios::out | std::ios::binary );
+	Pkg( header_stream ).Write( hdr );
+	std::string       header_bytes = header_stream.str() + table.str();
+
+	if ( !WriteAt( volumes[0]->Handle, header_bytes.data(), header_bytes.size(), 0 ) )
+	{
+		throw std::runtime_error( "unable to write volume: " + volume_paths[0] );
+	}
+
+	// One writer per volume, so each device is kept busy independently.
+	std::vector< std::exception_ptr > errors( volumes.size() );
+	std::vector< std::thread >        writers;
+
+	for ( size_t volume = 0; volume < volumes.size(); ++volume )
+	{
+		writers.emplace_back( [&, volume]()
+		{
+			try
+			{
+				for ( size_t i = 0; i < files.size(); ++i )
+				{
+					if ( item_volumes[i] != volume )
+					{
+						continue;
+					}
+
+					ScopedFile   source{ OpenFile( files[i].Path, false ) };
+					const Item & item = hdr.Items()[i];
+
+					if ( source.Handle == -1 || !CopyRange( source.Handle, 0, volumes[volume]->Handle, item.Offset(), item.Length() ) )
+					{
+						throw std::runtime_error( "unable to pack file: " + files[i].Path );
+					}
+				}
+			}
+			catch ( ... )
+			{
+				errors[volume] = std::current_exception();
+			}
+		} );
+	}
+
+	for ( auto & writer : writers )
+	{
+		writer.join();
+	}
+
+	for ( const auto & error : errors )
+	{
+		if ( error )
+		{
+			std::rethrow_exception( error );
+		}
+	}
+}
+
+#pragma endregion Split
+
+#pragma region Batch
+
+/// \brief Writes many packages in one pass, reading each distinct source file once no matter how many packages include it.
+/// Source files are distributed over a shared pool of threads. A file included by a single package is copied with a range copy;
+/// a file shared by several packages is read once and each block is written to every package that includes it.
+/// \param thread_count The number of threads, or 0 for one per hardware thread.
+/// Nothing is written until every source has been checked, and each package replaces its path only once all are complete.
+/// \throws std::runtime_error if two packages share a path, a package is also an input, a package would exceed 4 GiB,
+/// a file cannot be read or a package cannot be written.
+void BinPkg::PackBatch( const std::vector< BatchPackage > & packages, size_t thread_count )
+{
+	/// Where a source file's bytes are placed: the package and the offset of the item within it.
+	struct Destination
+	{
+		size_t Package;
+		uint64_t Offset;
+	};
+
+	struct Source
+	{
+		std::string Path;
+		uint64_t Size;
+		std::vector< Destination > Destinations;
+	};
+
+	std::vector< Source >                          sources;
+	std::unordered_map< std::string, size_t >      source_indexes;
+	std::vector< std::string >                     headers;
+	std::vector< std::unique_ptr< ScopedFile > >   outputs;
+	std::unordered_set< std::string >              package_paths;
+
+	for ( const auto & package : packages )
+	{
+		if ( !package_paths.insert( package.Path ).second )
+		{
+			throw std::runtime_error( "package listed more than once: " + package.Path );
+		}
+	}
+
+	// Every source is checked and every header built before any output is touched, so a bad input leaves existing packages intact.
+	for ( size_t package = 0; package < packages.size(); ++package )
+	{
+		std::vector< Item > items;
+
+		for ( const auto & file : packages[package].Files )
+		{
+			if ( package_paths.count( file.Path ) > 0 )
+			{
+				throw std::runtime_error( "package is also an input: " + file.Path );
+			}
+
+			auto result = source_indexes.emplace( file.Path, sources.size() );
+
+			if ( result.second )
+			{
+				struct stat statinfo;
+
+				if ( stat( file.Path.c_str(), &statinfo ) != 0 || statinfo.st_size > UINT32_MAX )
+				{
+					throw std::runtime_error( "unable to pack file: " + file.Path );
+				}
+				sources.push_back( Source{ file.Path, static_cast< uint64_t >( statinfo.st_size ), {} } );
+			}
+			items.push_back( Item( file.Name.c_str(), 0, static_cast< uint32_t >( sources[result.first->second].Size ) ) );
+		}
+		CheckPackageLength( items, packages[package].Path );
+		Header hdr( 0, std::move( items ) );
+
+		for ( size_t i = 0; i < packages[package].Files.size(); ++i )
+		{
+			sources[source_indexes[packages[package].Files[i].Path]].Destinations.push_back( Destination{ package, hdr.Get( static_cast< int >( i ) )->Offset() } );
+		}
+
+		std::stringstream header_stream( std::ios::in | std::ios::out | std::ios::binary );
+		Pkg( header_stream ).Write( hdr );
+		headers.push_back( header_stream.str() );
+	}
+
+	auto pack = [&]( const Source & source )
+				{
+					ScopedFile input{ OpenFile( source.Path, false ) };
+
+					if ( input.Handle == -1 )
+					{
+						throw std::runtime_error( "unable to pack file: " + source.Path );
+					}
+
+					if ( source.Destinations.size() == 1 )
+					{
+						const Destination & destination = source.Destinations[0];
+
+						if ( !CopyRange( input.Handle, 0, outputs[destination.Package]->Handle, destination.Offset, static_cast< size_t >( source.Size ) ) )
+						{
+							throw std::runtime_error( "unable to pack file: " + source.Path );
+						}
+						return;
+					}
+
+					std::vector< char > buffer( 1024 * 1024 );
+
+					for ( uint64_t offset = 0; offset < source.Size; )
+					{
+						size_t bytes_read = ReadAt( input.Handle, buffer.data(), static_cast< size_t >( std::min< uint64_t >( buffer.size(), source.Size - offset ) ), offset );
+
+						if ( bytes_read == 0 )
+						{
+							throw std::runtime_error( "unable to pack file: " + source.Path );
+						}
+
+						for ( const auto & destination : source.Destinations )
+						{
+							if ( !WriteAt( outputs[destination.Package]->Handle, buffer.data(), bytes_read, destination.Offset + offset ) )
+							{
+								throw std::runtime_error( "unable to write package: " + packages[destination.Package].Path );
+							}
+						}
+						offset += bytes_read;
+					}
+				};
+
+	if ( thread_count == 0 )
+	{
+		thread_count = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+	}
+
+	// Packages are written beside their paths and moved into place only once all of them are complete.
+	try
+	{
+		for ( size_t package = 0; package < packages.size(); ++package )
+		{
+			outputs.emplace_back( new ScopedFile{ OpenFile( packages[package].Path + ".tmp", true ) } );
+
+			if ( outputs.back()->Handle == -1 || !WriteAt( outputs.back()->Handle, headers[package].data(), headers[package].size(), 0 ) )
+			{
+				throw std::runtime_error( "unable to write package: " + packages[package].Path );
+			}
+		}
+
+		std::atomic< size_t >      next_source( 0 );
+		std::exception_ptr         error;
+		std::mutex                 error_mutex;
+		std::vector< std::thread > workers;
+
+		for ( size_t i = 0; i < std::min( thread_count, sources.size() ); ++i )
+		{
+			workers.emplace_back( [&]()
+			{
+				for ( size_t index = next_source++; index < sources.size(); index = next_source++ )
+				{
+					try
+					{
+						pack( sources[index] );
+					}
+					catch ( ... )
+					{
+						std::lock_guard< std::mutex > lock( error_mutex );
+						error = error ? error : std::current_exception();
+					}
+				}
+			} );
+		}
+
+		for ( auto & worker : workers )
+		{
+			worker.join();
+		}
+
+		if ( error )
+		{
+			std::rethrow_exception( error );
+		}
+	}
+	catch ( ... )
+	{
+		size_t opened = outputs.size();
+		outputs.clear();
+
+		for ( size_t package = 0; package < opened; ++package )
+		{
+			std::remove( ( packages[package].Path + ".tmp" ).c_str() );
+		}
+		throw;
+	}
+	outputs.clear();
+
+	for ( const auto & package : packages )
+	{
+		ReplaceFile( package.Path + ".tmp", package.Path );
+	}
+}
+
+#pragma endregion Batch
+
+#pragma region Emit
+
+/// \brief Writes \p name as a C string literal, escaping anything that is not printable ASCII.
+static void EmitStringLiteral( std::ostream & os, const char * name )
+{
+	os << '"';
+
+	for ( const char * c = name; *c != '\0'; ++c )
+	{
+		unsigned char uc = static_cast< unsigned char >( *c );
+
+		if ( uc == '"' || uc == '\\' )
+		{
+			os << '\\' << *c;
+		}
+		else if ( uc < 0x20 || uc > 0x7E )
+		{
+			// Octal escapes stop after 3 digits, unlike hex escapes which would swallow following characters.
+			os << '\\' << std::oct << std::setw( 3 ) << std::setfill( '0' ) << static_cast< int >( uc ) << std::dec;
+		}
+		else
+		{
+			os << *c;
+		}
+	}
+	os << '"';
+}
+
+/// \brief Writes a C++ source file defining the package bytes as `<symbol>_data`, for use with the header written by EmitHeader.
+/// Keeping the bytes out of the header means they are compiled, and stored in the binary, exactly once.
+/// \param os The stream to write the source to.
+/// \param symbol The prefix of the defined array. Must match the symbol passed to EmitHeader.
+/// \param data The complete package, as produced by Pkg::Write.
+/// \param data_length The number of bytes in \p data.
+void BinPkg::EmitCpp( std::ostream & os, const std::string & symbol, const char * data, size_t data_length )
+{
+	constexpr size_t BYTES_PER_LINE = 16;
+
+	os << "// Generated by binpkg. Do not edit.\n\n"
+	   << "extern \"C\" alignas( 16 ) const unsigned char " << symbol << "_data[] = {";
+
+	for ( size_t i = 0; i < data_length; ++i )
+	{
+		os << ( i % BYTES_PER_LINE == 0 ? "\n\t" : " " )
+		   << "0x" << std::hex << std::setw( 2 ) << std::setfill( '0' )
+		   << static_cast< int >( static_cast< unsigned char >( data[i] ) ) << std::dec << ',';
+	}
+	os << "\n};\n";
+}
+
+/// \brief Writes the C++ header declaring the data emitted by EmitCpp or EmitObject along with a constexpr item table.
+/// \param os The stream to write the header to.
+/// \param symbol The C++ identifier of the generated EmbeddedPkg, and the symbol passed to EmitCpp or EmitObject.
+/// \param hdr The header of the embedded package.
+/// \param data_length The number of bytes of the embedded package.
+void BinPkg::EmitHeader( std::ostream & os, const std::string & symbol, const Header & hdr, size_t data_length )
+{
+	os << "// Generated by binpkg. Do not edit.\n"
+	   << "#pragma once\n\n"
+	   << "#include <binpkg.h>\n\n"
+	   << "extern \"C\" const unsigned char " << symbol << "_data[];\n\n";
+
+	if ( hdr.ItemCount() > 0 )
+	{
+		os << "constexpr BinPkg::EmbeddedItem " << symbol << "_items[] = {\n";
+
+		for ( const auto & item : hdr.Items() )
+		{
+			os << "\t{ ";
+			EmitStringLiteral( os, item.Name() );
+			os << ", " << item.Offset() << "u, " << item.Length() << "u },\n";
+		}
+		os << "};\n\n";
+		os << "constexpr BinPkg::EmbeddedPkg " << symbol << "( " << symbol << "_data, " << data_length << "u, "
+		   << symbol << "_items, " << hdr.ItemCount() << "u );\n";
+	}
+	else
+	{
+		os << "constexpr BinPkg::EmbeddedPkg " << symbol << "( " << symbol << "_data, " << data_length << "u, nullptr, 0u );\n";
+	}
+}
+
+/// \brief Writes \p value as \p size little-endian bytes, independent of the host byte order.
+static void WriteLE( std::ostream & os, uint64_t value, size_t size )
+{
+	for ( size_t i = 0; i < size; ++i )
+	{
+		os.put( static_cast< char >( ( value >> ( 8 * i ) ) & 0xFF ) );
+	}
+}
+
+/// \brief Writes an ELF64 section header.
+static void WriteSectionHeader( std::ostream & os, uint32_t name, uint32_t type, uint64_t flags, uint64_t offset, uint64_t size,
+                                uint32_t link, uint32_t info, uint64_t alignment, uint64_t entsize )
+{
+	WriteLE( os, name, 4 );
+	WriteLE( os, type, 4 );
+	WriteLE( os, flags, 8 );
+	WriteLE( os, 0, 8 ); // sh_addr
+	WriteLE( os, offset, 8 );
+	WriteLE( os, size, 8 );
+	WriteLE( os, link, 4 );
+	WriteLE( os, info, 4 );
+	WriteLE( os, alignment, 8 );
+	WriteLE( os, entsize, 8 );
+}
+
+/// \brief Writes a relocatable ELF64 object exporting the package bytes as `<symbol>_data` in `.rodata`.
+/// The object targets the architecture binpkg was built for.
+/// \param os The stream to write the object to. Must be opened in binary mode.
+/// \param symbol The prefix of the exported symbol.
+/// \param data The complete package, as produced by Pkg::Write.
+/// \param data_length The number of bytes in \p data.
+void BinPkg::EmitObject( std::ostream & os, const std::string & symbol, const char * data, size_t data_length )
+{
+	constexpr size_t   EHDR_SIZE = 64;
+	constexpr size_t   SHDR_SIZE = 64;
+	constexpr size_t   SYM_SIZE = 24;
+	constexpr size_t   SECTION_COUNT = 6;
+#if defined( __aarch64__ ) || defined( _M_ARM64 )
+	constexpr uint16_t MACHINE = 183; // EM_AARCH64
+#else
+	constexpr uint16_t MACHINE = 62; // EM_X86_64
+#endif
+	const std::string shstrtab( "\0.rodata\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack\0", 51 );
+	const std::string strtab = std::string( 1, '\0' ) + symbol + "_data" + '\0';
+	auto              align = []( size_t value, size_t alignment ) { return ( value + alignment - 1 ) & ~( alignment - 1 ); };
+
+	size_t rodata_offset = align( EHDR_SIZE, 16 );
+	size_t symtab_offset = align( rodata_offset + data_length, 8 );
+	size_t symtab_size = SYM_SIZE * 2;
+	size_t strtab_offset = symtab_offset + symtab_size;
+	size_t shstrtab_offset = strtab_offset + strtab.size();
+	size_t shdr_offset = align( shstrtab_offset + shstrtab.size(), 8 );
+	size_t position = 0;
+	auto   pad_to = [&]( size_t offset ) { for (; position < offset; ++position ) { os.put( '\0' ); } };
+
+	// ELF header
+	os.write( "\x7F" "ELF\x02\x01\x01", 7 ); // ELFCLASS64, ELFDATA2LSB, EV_CURRENT
+	WriteLE( os, 0, 9 );
+	WriteLE( os, 1, 2 ); // ET_REL
+	WriteLE( os, MACHINE, 2 );
+	WriteLE( os, 1, 4 ); // EV_CURRENT
+	WriteLE( os, 0, 8 ); // e_entry
+	WriteLE( os, 0, 8 ); // e_phoff
+	WriteLE( os, shdr_offset, 8 );
+	WriteLE( os, 0, 4 ); // e_flags
+	WriteLE( os, EHDR_SIZE, 2 );
+	WriteLE( os, 0, 2 ); // e_phentsize
+	WriteLE( os, 0, 2 ); // e_phnum
+	WriteLE( os, SHDR_SIZE, 2 );
+	WriteLE( os, SECTION_COUNT, 2 );
+	WriteLE( os, 4, 2 ); // e_shstrndx
+	position = EHDR_SIZE;
+
+	pad_to( rodata_offset );
+	os.write( data, data_length );
+	position += data_length;
+
+	// .symtab: the mandatory null symbol followed by the global data symbol.
+	pad_to( symtab_offset );
+	WriteLE( os, 0, SYM_SIZE );
+	WriteLE( os, 1, 4 );       // st_name
+	os.put( ( 1 << 4 ) | 1 ); // STB_GLOBAL, STT_OBJECT
+	os.put( 0 );              // STV_DEFAULT
+	WriteLE( os, 1, 2 );       // .rodata
+	WriteLE( os, 0, 8 );       // st_value
+	WriteLE( os, data_length, 8 );
+	os.write( strtab.data(), strtab.size() );
+	os.write( shstrtab.data(), shstrtab.size() );
+	position = shstrtab_offset + shstrtab.size();
+	pad_to( shdr_offset );
+
+	WriteSectionHeader( os, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+	WriteSectionHeader( os, 1, 1, 2, rodata_offset, data_length, 0, 0, 16, 0 );         // .rodata: SHT_PROGBITS, SHF_ALLOC
+	WriteSectionHeader( os, 9, 2, 0, symtab_offset, symtab_size, 3, 1, 8, SYM_SIZE );   // .symtab: SHT_SYMTAB, first global is 1
+	WriteSectionHeader( os, 17, 3, 0, strtab_offset, strtab.size(), 0, 0, 1, 0 );       // .strtab: SHT_STRTAB
+	WriteSectionHeader( os, 25, 3, 0, shstrtab_offset, shstrtab.size(), 0, 0, 1, 0 );   // .shstrtab: SHT_STRTAB
+	WriteSectionHeader( os, 35, 1, 0, shdr_offset, 0, 0, 0, 1, 0 );                     // .note.GNU-stack: non-executable stack
+}
+
+#pragma endregion Emit
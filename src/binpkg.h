@@ -1,7 +1,14 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <map>
 
@@ -50,6 +57,7 @@ namespace BinPkg
 	{
 	public:
 		Header( int32_t version = 0 );
+		Header( int32_t version, std::vector< Item > items );
 		int32_t Version() const;
 		void SetVersion( int32_t value );
 		std::size_t ItemCount() const;
@@ -72,6 +80,7 @@ namespace BinPkg
 	public:
 		Pkg( std::iostream & stream );
 
+		int32_t ParseVersion();
 		Header ParseHeader();
 		Header & HeaderMut() &;
 		// void Add( Item item, std::iostream & stream );
@@ -89,4 +98,270 @@ namespace BinPkg
 		/// The io stream for the package file.
 		std::iostream & m_stream;
 	};
+
+	/// A read-only stream buffer over bytes already in memory, e.g. a package embedded with `binpkg --emit-cpp`.
+	/// Wrap it in a `std::iostream` to read the bytes through Pkg.
+	class MemoryStreamBuf :
+		public std::streambuf
+	{
+	public:
+		MemoryStreamBuf( const unsigned char * data, std::size_t data_length );
+
+	protected:
+		pos_type seekoff( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which ) override;
+		pos_type seekpos( pos_type pos, std::ios_base::openmode which ) override;
+	};
+
+	/// An item of a package embedded into a binary via `binpkg --emit-cpp` or `binpkg --emit-object`.
+	struct EmbeddedItem
+	{
+		/// A user friendly name for the item.
+		const char * Name;
+		/// The offset into the packaged bytes.
+		uint32_t Offset;
+		/// The number of bytes of the item.
+		uint32_t Length;
+	};
+
+	/// A read-only view of a package embedded into a binary.
+	/// The item table is generated at pack time, so no header parsing is required at startup
+	/// and lookups by name may be resolved at compile time.
+	class EmbeddedPkg
+	{
+	public:
+		constexpr EmbeddedPkg( const unsigned char * data, std::size_t data_length, const EmbeddedItem * items, std::size_t item_count )
+			:
+			m_data( data ),
+			m_data_length( data_length ),
+			m_items( items ),
+			m_item_count( item_count )
+		{
+		}
+
+		/// \return All packaged bytes, including the header.
+		constexpr const unsigned char * Bytes() const
+		{
+			return m_data;
+		}
+
+		constexpr std::size_t Size() const
+		{
+			return m_data_length;
+		}
+
+		constexpr std::size_t ItemCount() const
+		{
+			return m_item_count;
+		}
+
+		constexpr const EmbeddedItem & Get( std::size_t index ) const
+		{
+			return m_items[index];
+		}
+
+		/// \return The index of the item named \p name, or -1 if no such item exists.
+		constexpr int Find( const char * name ) const
+		{
+			for ( std::size_t i = 0; i < m_item_count; ++i )
+			{
+				if ( NameEquals( m_items[i].Name, name ) )
+				{
+					return static_cast< int >( i );
+				}
+			}
+			return -1;
+		}
+
+		/// \return A pointer to the first byte of the item at \p index, or nullptr if there is no such item
+		/// (e.g. \p index is the -1 returned by Find for a missing name).
+		constexpr const unsigned char * Data( std::size_t index ) const
+		{
+			return index < m_item_count ? m_data + m_items[index].Offset : nullptr;
+		}
+
+	protected:
+		static constexpr bool NameEquals( const char * lhs, const char * rhs )
+		{
+			while ( *lhs != '\0' && *lhs == *rhs )
+			{
+				++lhs;
+				++rhs;
+			}
+			return *lhs == *rhs;
+		}
+
+		const unsigned char * m_data;
+		std::size_t m_data_length;
+		const EmbeddedItem * m_items;
+		std::size_t m_item_count;
+	};
+
+	/// The name of the trailing item in which Repack records a SourceInfo per item.
+	static constexpr const char * SOURCES_ITEM_NAME = ".binpkg.sources";
+	/// The name of the trailing item in which Split records the volume files and the volume of each item.
+	static constexpr const char * VOLUMES_ITEM_NAME = ".binpkg.volumes";
+	/// The name of the trailing patch item in which Diff records a hash of each item of the old package.
+	static constexpr const char * BASE_ITEM_NAME = ".binpkg.base";
+
+	/// A read-only package that is safe to share between threads.
+	/// The header is parsed once at construction and never modified afterwards,
+	/// and item data is read with positional reads so no stream position is shared between callers.
+	class Reader
+	{
+	public:
+		/// \throws std::runtime_error if \p path cannot be opened.
+		Reader( const std::string & path );
+		Reader( const unsigned char * data, std::size_t data_length );
+		Reader( const EmbeddedPkg & pkg );
+		Reader( const Reader & ) = delete;
+		Reader & operator=( const Reader & ) = delete;
+		~Reader();
+
+		const Header & GetHeader() const;
+		std::size_t ItemCount() const;
+		const Item * Get( int index ) const;
+		int Find( const std::string & name ) const;
+		std::size_t Read( int index, std::size_t offset, char * buf, std::size_t buf_length ) const;
+		bool Copy( int index, std::size_t offset, std::size_t length, intptr_t file, uint64_t file_offset ) const;
+		void Prefetch( const std::vector< int > & indexes ) const;
+		void WillNeed( const std::string & name ) const;
+		void Drop( const std::vector< int > & indexes ) const;
+		void DontNeed( const std::string & name ) const;
+
+	protected:
+		void ParseHeader( std::iostream & stream );
+		void OpenVolumes( const std::string & path );
+		void Close();
+		intptr_t FileFor( int index ) const;
+		void Advise( int index, bool will_need ) const;
+
+		Header m_header;
+		/// Map of item names to their index in the header.
+		std::unordered_map< std::string, int > m_names;
+		/// The bytes of a memory-backed package, or nullptr if file-backed.
+		const unsigned char * m_data;
+		std::size_t m_data_length;
+		/// The OS file handle of a file-backed package.
+		intptr_t m_file;
+		/// The OS file handles of any additional volumes written by Split.
+		std::vector< intptr_t > m_volumes;
+		/// The volume of each item, or empty if the package has a single volume.
+		std::vector< uint32_t > m_item_volumes;
+	};
+
+	/// A read-only union of several packages, e.g. a base package followed by patch packages.
+	/// Items of later packages shadow same-named items of earlier ones.
+	/// The merged index is built once at construction, so lookups cost the same as for a single Reader,
+	/// and like Reader it is safe to share between threads.
+	class Overlay
+	{
+	public:
+		/// \throws std::runtime_error if any of \p paths cannot be opened.
+		Overlay( const std::vector< std::string > & paths );
+
+		std::size_t ItemCount() const;
+		const Item * Get( int index ) const;
+		int Find( const std::string & name ) const;
+		std::size_t Read( int index, std::size_t offset, char * buf, std::size_t buf_length ) const;
+
+	protected:
+		/// The package and index within it that a merged index resolves to.
+		struct Entry
+		{
+			const Reader * Source;
+			int Index;
+		};
+
+		std::vector< std::unique_ptr< Reader > > m_readers;
+		std::vector< Entry > m_entries;
+		/// Map of item names to their merged index.
+		std::unordered_map< std::string, int > m_names;
+	};
+
+	/// A cache of whole items read through a Reader, bounded by a byte budget.
+	/// Entries are spread across independently locked shards by item index to limit lock contention,
+	/// and each shard evicts its least recently used items once its share of the budget is exceeded.
+	class ItemCache
+	{
+	public:
+		/// An immutable item buffer, safe to hold after the item has been evicted.
+		using Buffer = std::shared_ptr< const std::vector< char > >;
+
+		struct Stats
+		{
+			uint64_t Hits;
+			uint64_t Misses;
+			uint64_t Evictions;
+		};
+
+		ItemCache( const Reader & reader, std::size_t byte_budget, std::size_t shard_count = 16 );
+
+		Buffer Get( int index );
+		Stats GetStats() const;
+		std::size_t Size() const;
+
+	protected:
+		struct Shard
+		{
+			std::mutex Mutex;
+			/// Item indexes ordered from most to least recently used.
+			std::list< int > Lru;
+			std::unordered_map< int, std::pair< Buffer, std::list< int >::iterator > > Entries;
+			std::size_t Bytes = 0;
+			Stats Counters = {};
+		};
+
+		Shard & ShardFor( int index ) const;
+
+		const Reader & m_reader;
+		/// The byte budget of each shard.
+		std::size_t m_shard_budget;
+		std::vector< std::unique_ptr< Shard > > m_shards;
+	};
+
+	void Diff( const Reader & old_pkg, const Reader & new_pkg, std::iostream & patch );
+	void Apply( const Reader & old_pkg, const Reader & patch, const std::string & new_path );
+
+	/// Metadata about the file an item was packed from, recorded so a later repack can skip unchanged files.
+	struct SourceInfo
+	{
+		uint64_t Size;
+		/// The modification time, in nanoseconds since the epoch where the platform provides them.
+		int64_t MTime;
+		/// The FNV-1a hash of the file contents, or 0 if not recorded.
+		uint64_t Hash;
+	};
+
+	/// A file to package with Repack.
+	struct RepackFile
+	{
+		std::string Path;
+		/// The item name.
+		std::string Name;
+	};
+
+	struct RepackStats
+	{
+		/// The number of items copied from the previous package.
+		std::size_t Reused;
+		/// The number of items copied from their source file.
+		std::size_t Packed;
+	};
+
+	std::vector< SourceInfo > ReadSources( const Reader & pkg );
+	RepackStats Repack( const std::vector< RepackFile > & files, const Reader * previous, const std::string & path, bool hash = false );
+	void Split( const std::vector< RepackFile > & files, const std::vector< std::string > & volume_paths, uint64_t volume_size );
+
+	/// A package to write with PackBatch.
+	struct BatchPackage
+	{
+		std::string Path;
+		std::vector< RepackFile > Files;
+	};
+
+	void PackBatch( const std::vector< BatchPackage > & packages, std::size_t thread_count = 0 );
+
+	void EmitCpp( std::ostream & os, const std::string & symbol, const char * data, std::size_t data_length );
+	void EmitObject( std::ostream & os, const std::string & symbol, const char * data, std::size_t data_length );
+	void EmitHeader( std::ostream & os, const std::string & symbol, const Header & hdr, std::size_t data_length );
 }
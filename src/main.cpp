@@ -1,8 +1,12 @@
 #include <algorithm>
-#include <cassert>
+#include <cctype>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 #include <sys/stat.h>
 
 #include <binpkg.h>
@@ -25,12 +29,34 @@ USAGE:
   binpkg --version
   binpkg -h
   binpkg [-V] -o OUTFILE FILES...
+  binpkg [-V] --incremental PREVIOUS [--hash] -o OUTFILE FILES...
+  binpkg [-V] --volume VOLUME... [--volume-size BYTES] -o OUTFILE FILES...
+  binpkg [-V] --manifest FILE [-j N]
+  binpkg [-V] --emit-cpp HEADER FILES...
+  binpkg [-V] --emit-object OBJECT FILES...
+  binpkg [-V] --warm PKG
+  binpkg [-V] --diff OLD NEW -o PATCH
+  binpkg [-V] --apply OLD PATCH -o NEW
 
 OPTIONS:
   --version                         Print the version info
   -h, --help                        Print this menu
   -V                                Verbose output.
   -o, --output                      The output file
+  --incremental                     Reuse the payload of files unchanged since PREVIOUS was packed (may be OUTFILE)
+  --hash                            With --incremental, record content hashes and reuse files whose contents did not change
+  --volume                          Spread items across OUTFILE and this additional volume file, e.g. one per disk (repeatable)
+                                    Relative paths are relative to the directory of OUTFILE
+  --volume-size                     With --volume, the maximum size of each volume in bytes
+  --manifest                        Write every package listed in FILE, one per line as "OUTFILE: FILES...".
+                                    Blank lines and lines starting with # are ignored
+  -j                                With --manifest, the number of threads (default: one per hardware thread)
+  --emit-cpp                        Write a C++ header with a constexpr item table, plus a C++ source embedding the package (HEADER with its extension
+                                    replaced by .cpp, so HEADER must not itself end in .cpp)
+  --emit-object                     Write an ELF object embedding the package, plus a C++ header (OBJECT with a .h extension)
+  --warm                            Ask the OS to load all items of PKG into the page cache
+  --diff                            Write a patch that rebuilds package NEW from package OLD
+  --apply                           Rebuild a package from package OLD and a patch written by --diff
 )END";
 }
 
@@ -45,11 +71,48 @@ char * cmdGetOption( char ** begin, char ** end, const std::string & option )
 	return nullptr;
 }
 
+/// \return The argument of every occurrence of \p option.
+std::vector< std::string > cmdGetOptions( char ** begin, char ** end, const std::string & option )
+{
+	std::vector< std::string > values;
+
+	for ( char ** itr = std::find( begin, end, option ); itr != end && ++itr != end; itr = std::find( itr, end, option ) )
+	{
+		values.push_back( *itr );
+	}
+	return values;
+}
+
 bool cmdOptionExists( char ** begin, char ** end, const std::string & option )
 {
 	return std::find( begin, end, option ) != end;
 }
 
+/// \return The arguments that are neither options nor the argument of an option.
+std::vector< std::string > cmdPositionals( char ** begin, char ** end )
+{
+	const std::set< std::string > options_with_arg{ "-o", "--output", "--emit-cpp", "--emit-object", "--incremental", "--warm", "--volume", "--volume-size", "--manifest", "-j" };
+	std::vector< std::string >     positionals;
+
+	for ( char ** arg = begin; arg != end; arg++ )
+	{
+		if ( options_with_arg.count( *arg ) > 0 )
+		{
+			arg++;
+
+			if ( arg == end )
+			{
+				break;
+			}
+		}
+		else if ( ( *arg )[0] != '-' )
+		{
+			positionals.push_back( *arg );
+		}
+	}
+	return positionals;
+}
+
 std::vector< std::string > splitpath( const std::string & str, const std::set< char > delimiters )
 {
 	std::vector< std::string > result;
@@ -83,12 +146,11 @@ struct FileInfo
 	std::fstream file_stream;
 };
 
-std::vector< FileInfo > ParseFiles( char ** begin, char ** end )
+std::vector< FileInfo > ParseFiles( const std::vector< std::string > & paths )
 {
 	std::vector< FileInfo > files;
-	for ( char ** arg = begin; arg != end; arg++ )
+	for ( const auto & path : paths )
 	{
-		std::string   path( *arg );
 		std::ifstream file( path, std::ifstream::binary );
 
 		if ( file.good() )
@@ -99,7 +161,144 @@ std::vector< FileInfo > ParseFiles( char ** begin, char ** end )
 	return files;
 }
 
-int main( int argc, char * argv[] )
+/// \brief Adds each of \p files to \p pkg, named after the last component of its path.
+void AddFiles( Pkg & pkg, std::vector< FileInfo > & files )
+{
+	std::set< char > delims{'/', '\\'};
+
+	for ( auto & file : files )
+	{
+		struct stat                statinfo;
+		int                        rc = stat( file.path.c_str(), &statinfo );
+		std::vector< std::string > path_tokens = splitpath( file.path, delims );
+		DEBUG( file.path << ": " << ( rc == 0 ? statinfo.st_size : -1 ) << std::endl; );
+		pkg.Add( path_tokens.back(), statinfo.st_size, file.file_stream );
+	}
+}
+
+/// \brief Derives a C++ identifier from the file name of \p path, e.g. "out/my-assets.h" becomes "my_assets".
+std::string SymbolName( const std::string & path )
+{
+	std::string name = splitpath( path, {'/', '\\'} ).back();
+	name = name.substr( 0, name.find( '.' ) );
+
+	for ( auto & c : name )
+	{
+		if ( !std::isalnum( static_cast< unsigned char >( c ) ) )
+		{
+			c = '_';
+		}
+	}
+
+	if ( name.empty() || std::isdigit( static_cast< unsigned char >( name[0] ) ) )
+	{
+		name.insert( name.begin(), '_' );
+	}
+	return name;
+}
+
+/// \return \p path with its extension, if any, replaced by \p extension.
+std::string ReplaceExtension( const std::string & path, const std::string & extension )
+{
+	std::string result( path );
+	size_t      dot = result.find_last_of( '.' );
+
+	if ( dot != std::string::npos && result.find_first_of( "/\\", dot ) == std::string::npos )
+	{
+		result.erase( dot );
+	}
+	return result + extension;
+}
+
+/// \brief Packages \p files in memory for embedding into a binary.
+/// \return The complete package bytes.
+std::string PackInMemory( std::vector< FileInfo > & files, Header & hdr )
+{
+	std::stringstream ss( std::ios::in | std::ios::out | std::ios::binary );
+	Pkg               pkg( ss );
+	AddFiles( pkg, files );
+	pkg.Write();
+	hdr = pkg.HeaderMut();
+	return ss.str();
+}
+
+/// \brief Parses a manifest listing one package per line as "OUTFILE: FILES...".
+/// Blank lines and lines starting with '#' are ignored.
+/// \throws std::runtime_error naming the line number if a line is malformed or repeats an earlier OUTFILE.
+std::vector< BatchPackage > ParseManifest( std::istream & is )
+{
+	std::vector< BatchPackage > packages;
+	std::set< std::string >     package_paths;
+	std::string                 line;
+
+	for ( size_t line_number = 1; std::getline( is, line ); ++line_number )
+	{
+		size_t start = line.find_first_not_of( " \t\r" );
+
+		if ( start == std::string::npos || line[start] == '#' )
+		{
+			continue;
+		}
+
+		// Skip colons within paths, such as Windows drive letters.
+		size_t colon = line.find( ':' );
+
+		while ( colon != std::string::npos && colon + 1 < line.size() && !std::isspace( static_cast< unsigned char >( line[colon + 1] ) ) )
+		{
+			colon = line.find( ':', colon + 1 );
+		}
+
+		if ( colon == std::string::npos || colon == 0 )
+		{
+			throw std::runtime_error( "manifest line " + std::to_string( line_number ) + ": expected \"OUTFILE: FILES...\"" );
+		}
+
+		BatchPackage       package;
+		std::istringstream files( line.substr( colon + 1 ) );
+		std::string        path;
+		package.Path = line.substr( 0, colon );
+
+		if ( !package_paths.insert( package.Path ).second )
+		{
+			throw std::runtime_error( "manifest line " + std::to_string( line_number ) + ": " + package.Path + " is listed more than once" );
+		}
+
+		while ( files >> path )
+		{
+			package.Files.push_back( RepackFile{ path, splitpath( path, {'/', '\\'} ).back() } );
+		}
+		packages.push_back( package );
+	}
+	return packages;
+}
+
+/// \brief Reads every item at \p indexes so it is in the page cache by the time this returns.
+/// Prefetch alone only queues readahead, which the OS may not have finished (or even started) when the process exits.
+void Warm( const Reader & reader, const std::vector< int > & indexes )
+{
+	std::vector< char > buffer( 1024 * 1024 );
+
+	// Let the OS start reading everything while the items are faulted in one by one.
+	reader.Prefetch( indexes );
+
+	for ( int index : indexes )
+	{
+		size_t offset = 0;
+		size_t bytes_read = 0;
+
+		while ( ( bytes_read = reader.Read( index, offset, buffer.data(), buffer.size() ) ) > 0 )
+		{
+			offset += bytes_read;
+		}
+
+		if ( offset < reader.Get( index )->Length() )
+		{
+			throw std::runtime_error( "unable to read item: " + reader.Get( index )->NameCopy() );
+		}
+	}
+}
+
+int Run( int argc, char * argv[] )
 {
 	if ( cmdOptionExists( argv, argv + argc, "-h" ) || cmdOptionExists( argv, argv + argc, "--help" ) )
 	{
@@ -118,6 +317,40 @@ int main( int argc, char * argv[] )
 		VERBOSITY = 1;
 	}
 
+	char * manifest_path = cmdGetOption( argv, argv + argc, "--manifest" );
+
+	if ( manifest_path != nullptr )
+	{
+		std::ifstream manifest( manifest_path );
+
+		if ( !manifest )
+		{
+			throw std::runtime_error( std::string( "unable to open manifest: " ) + manifest_path );
+		}
+
+		std::vector< BatchPackage > packages = ParseManifest( manifest );
+		char                        * thread_count = cmdGetOption( argv, argv + argc, "-j" );
+		DEBUG( "packing " << packages.size() << " packages from " << manifest_path << std::endl; );
+		PackBatch( packages, thread_count != nullptr ? std::stoul( thread_count ) : 0 );
+		return 0;
+	}
+
+	char * warm_path = cmdGetOption( argv, argv + argc, "--warm" );
+
+	if ( warm_path != nullptr )
+	{
+		Reader             reader( warm_path );
+		std::vector< int > indexes;
+
+		for ( int i = 0; i < static_cast< int >( reader.ItemCount() ); ++i )
+		{
+			indexes.push_back( i );
+		}
+		DEBUG( "warming " << indexes.size() << " items of " << warm_path << std::endl; );
+		Warm( reader, indexes );
+		return 0;
+	}
+
 	char * output_path = cmdGetOption( argv, argv + argc, "-o" );
 
 	if ( output_path == nullptr )
@@ -125,26 +358,154 @@ int main( int argc, char * argv[] )
 		output_path = cmdGetOption( argv, argv + argc, "--output" );
 	}
 
+	char ** diff_itr = std::find( argv, argv + argc, std::string( "--diff" ) );
+
+	if ( diff_itr != argv + argc && argv + argc - diff_itr > 2 && output_path != nullptr )
+	{
+		Reader       old_pkg( diff_itr[1] );
+		Reader       new_pkg( diff_itr[2] );
+		std::fstream os( output_path, std::fstream::out | std::fstream::binary );
+		Diff( old_pkg, new_pkg, os );
+		return 0;
+	}
+
+	char ** apply_itr = std::find( argv, argv + argc, std::string( "--apply" ) );
+
+	if ( apply_itr != argv + argc && argv + argc - apply_itr > 2 && output_path != nullptr )
+	{
+		Reader old_pkg( apply_itr[1] );
+		Reader patch( apply_itr[2] );
+		Apply( old_pkg, patch, output_path );
+		return 0;
+	}
+
+	std::vector< std::string > volume_paths = cmdGetOptions( argv, argv + argc, "--volume" );
+
+	if ( output_path != nullptr && !volume_paths.empty() )
+	{
+		std::vector< RepackFile > files;
+		char                      * volume_size = cmdGetOption( argv, argv + argc, "--volume-size" );
+
+		for ( auto & file : ParseFiles( cmdPositionals( argv + 1, argv + argc ) ) )
+		{
+			files.push_back( RepackFile{ file.path, splitpath( file.path, {'/', '\\'} ).back() } );
+		}
+		volume_paths.insert( volume_paths.begin(), output_path );
+		Split( files, volume_paths, volume_size != nullptr ? std::stoull( volume_size ) : 0 );
+		DEBUG( "split " << files.size() << " items across " << volume_paths.size() << " volumes" << std::endl; );
+		return 0;
+	}
+
+	char * previous_path = cmdGetOption( argv, argv + argc, "--incremental" );
+
+	if ( output_path != nullptr && previous_path != nullptr )
+	{
+		std::vector< RepackFile > files;
+		std::unique_ptr< Reader > previous;
+
+		for ( auto & file : ParseFiles( cmdPositionals( argv + 1, argv + argc ) ) )
+		{
+			files.push_back( RepackFile{ file.path, splitpath( file.path, {'/', '\\'} ).back() } );
+		}
+
+		// The first incremental build has no previous package.
+		if ( std::ifstream( previous_path ).good() )
+		{
+			previous.reset( new Reader( previous_path ) );
+		}
+
+		// Write alongside, since the previous package may be the output itself.
+		std::string temp_path = std::string( output_path ) + ".tmp";
+		RepackStats stats;
+
+		try
+		{
+			stats = Repack( files, previous.get(), temp_path, cmdOptionExists( argv, argv + argc, "--hash" ) );
+		}
+		catch ( ... )
+		{
+			std::remove( temp_path.c_str() );
+			throw;
+		}
+		previous.reset();
+#ifdef _WIN32
+		// rename cannot replace an existing file on Windows; elsewhere it replaces the target atomically.
+		std::remove( output_path );
+#endif
+
+		// The temp file is kept on failure, since on Windows it may be the only copy left.
+		if ( std::rename( temp_path.c_str(), output_path ) != 0 )
+		{
+			throw std::runtime_error( "unable to replace " + std::string( output_path ) + " with " + temp_path );
+		}
+		DEBUG( "reused " << stats.Reused << " items, packed " << stats.Packed << " items" << std::endl; );
+		return 0;
+	}
+
 	if ( output_path != nullptr )
 	{
-		assert( argc >= 3 );
-		// +3 to skip the program itself, -o, and -o arg
-		std::vector< FileInfo > files = ParseFiles( argv + 3, argv + argc );
+		std::vector< FileInfo > files = ParseFiles( cmdPositionals( argv + 1, argv + argc ) );
 		std::fstream            os( output_path, std::fstream::out | std::fstream::binary );
-		Pkg              pkg( os );
-		uint32_t         offset = 0;
-		std::set< char > delims{'/', '\\'};
+		Pkg                     pkg( os );
+		AddFiles( pkg, files );
+		pkg.Write();
+	}
+
+	char * cpp_path = cmdGetOption( argv, argv + argc, "--emit-cpp" );
 
-		for ( auto & file : files )
+	if ( cpp_path != nullptr )
+	{
+		std::string source_path = ReplaceExtension( cpp_path, ".cpp" );
+
+		// The source is written beside the header, so the header must not be named like the source.
+		if ( source_path == cpp_path )
 		{
-			struct stat                statinfo;
-			int                        rc = stat( file.path.c_str(), &statinfo );
-			std::vector< std::string > path_tokens = splitpath( file.path, delims );
-			DEBUG( file.path << ": " << ( rc == 0 ? statinfo.st_size : -1 ) << std::endl; );
-			pkg.Add( path_tokens.back(), statinfo.st_size, file.file_stream );
+			throw std::runtime_error( std::string( "--emit-cpp HEADER must not have a .cpp extension: " ) + cpp_path );
 		}
-		pkg.Write();
+
+		std::vector< FileInfo > files = ParseFiles( cmdPositionals( argv + 1, argv + argc ) );
+		Header                  hdr;
+		std::string             data = PackInMemory( files, hdr );
+		std::string             symbol = SymbolName( cpp_path );
+		std::ofstream           header_os( cpp_path );
+		std::ofstream           source_os( source_path );
+		EmitHeader( header_os, symbol, hdr, data.size() );
+		EmitCpp( source_os, symbol, data.data(), data.size() );
+	}
+
+	char * object_path = cmdGetOption( argv, argv + argc, "--emit-object" );
+
+	if ( object_path != nullptr )
+	{
+		std::string header_path = ReplaceExtension( object_path, ".h" );
+
+		if ( header_path == object_path )
+		{
+			throw std::runtime_error( std::string( "--emit-object OBJECT must not have a .h extension: " ) + object_path );
+		}
+
+		std::vector< FileInfo > files = ParseFiles( cmdPositionals( argv + 1, argv + argc ) );
+		Header                  hdr;
+		std::string             data = PackInMemory( files, hdr );
+		std::string             symbol = SymbolName( object_path );
+		std::ofstream           object_os( object_path, std::ofstream::binary );
+		std::ofstream           header_os( header_path );
+		EmitObject( object_os, symbol, data.data(), data.size() );
+		EmitHeader( header_os, symbol, hdr, data.size() );
 	}
 
 	return 0;
 }
+
+int main( int argc, char * argv[] )
+{
+	try
+	{
+		return Run( argc, argv );
+	}
+	catch ( const std::exception & e )
+	{
+		std::cerr << "binpkg: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -1,6 +1,12 @@
 
+#include <array>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
 #include <catch2/catch_test_macros.hpp>
 
 #include <binpkg.h>
@@ -102,6 +108,22 @@ void CreateAsciiPatternCString( char * buf, size_t len )
 	}
 }
 
+/// \brief Writes a package at \p path containing one item per entry of \p contents, named "0", "1", etc.
+void WriteTestPackage( const char * path, const std::vector< std::string > & contents )
+{
+	std::fstream                      os( path, std::ios::out | std::ios::binary );
+	std::vector< std::stringstream >  streams;
+	Pkg                               pkg( os );
+	streams.reserve( contents.size() );
+
+	for ( size_t i = 0; i < contents.size(); ++i )
+	{
+		streams.emplace_back( contents[i], std::ios::in | std::ios::out | std::ios::binary );
+		pkg.Add( std::to_string( i ), static_cast< uint32_t >( contents[i].size() ), streams.back() );
+	}
+	pkg.Write();
+}
+
 TEST_CASE( "Item IsEmpty returns true when all values are zero" )
 {
 	Item item( "", 0, 0 );
@@ -157,6 +179,21 @@ TEST_CASE( "Header Add recursively updates offsets" )
 	REQUIRE( hdr.Get( 1 )->Offset() == expected_offset );
 }
 
+TEST_CASE( "Header constructed from items lays them out contiguously" )
+{
+	Item   item1( "first.bin", 0, 7 );
+	Item   item2( "test.txt", 0, 9 );
+	Header hdr( 3, { item1, item2 } );
+	size_t expected_offset = Item::EMPTY_ITEM_SIZE
+	                         + sizeof( hdr.Version())
+	                         + item1.Size()
+	                         + item2.Size();
+	REQUIRE( hdr.Version() == 3 );
+	REQUIRE( hdr.Get( 0 )->Offset() == expected_offset );
+	expected_offset += item1.Length();
+	REQUIRE( hdr.Get( 1 )->Offset() == expected_offset );
+}
+
 TEST_CASE( "Pkg ReadCString returns zero when empty string" )
 {
 	char              data[] = {0};
@@ -336,3 +373,447 @@ TEST_CASE( "Pkg Add recursively updates offsets" )
 //     std::memcpy( actual_data1.data(), &stream_buf[file_data1_offset], file_data1.size() );
 //     REQUIRE_THAT( actual_data1, EqualsRange( file_data1 ) );
 // }
+
+TEST_CASE( "Pkg Write Header writes terminating empty item" )
+{
+	char              data[64];
+	std::memset( data, 0x55, sizeof( data ) );
+	memstream< char > stream( data, sizeof( data ) );
+	Pkg               pkg( stream );
+	Header            hdr;
+	pkg.Write( hdr );
+	char expected[Item::EMPTY_ITEM_SIZE] = {0};
+	REQUIRE( std::memcmp( &data[sizeof( hdr.Version())], expected, sizeof( expected ) ) == 0 );
+}
+
+TEST_CASE( "Pkg ParseVersion returns version written by Write" )
+{
+	char              data[64] = {0};
+	memstream< char > stream( data, sizeof( data ) );
+	Pkg               pkg( stream );
+	pkg.Write( Header( 3 ) );
+	REQUIRE( pkg.ParseVersion() == 3 );
+	REQUIRE( pkg.ParseHeader().ItemCount() == 0 );
+}
+
+TEST_CASE( "EmbeddedPkg Find resolves names at compile time" )
+{
+	static constexpr unsigned char        data[] = {'a', 'b', 'c'};
+	static constexpr EmbeddedItem         items[] = { { "first.bin", 0, 1 }, { "test.txt", 1, 2 } };
+	static constexpr EmbeddedPkg          pkg( data, sizeof( data ), items, 2 );
+	static_assert( pkg.Find( "test.txt" ) == 1, "Find must be usable in constant expressions" );
+	REQUIRE( pkg.Find( "first.bin" ) == 0 );
+	REQUIRE( pkg.Find( "first" ) == -1 );
+	REQUIRE( *pkg.Data( 1 ) == 'b' );
+	REQUIRE( pkg.Data( pkg.Find( "missing" ) ) == nullptr );
+	static_assert( pkg.Data( pkg.Find( "missing" ) ) == nullptr, "Data must reject a missing name in constant expressions" );
+}
+
+TEST_CASE( "MemoryStreamBuf allows Pkg to parse embedded bytes" )
+{
+	std::array< char, 4 > file_data = {'d', 'a', 't', 'a'};
+	memstream< char >     file_stream( file_data.data(), file_data.size() );
+	std::stringstream     os( std::ios::in | std::ios::out | std::ios::binary );
+	Pkg                   writer( os );
+	writer.Add( "test.txt", static_cast< uint32_t >( file_data.size() ), file_stream );
+	writer.Write();
+	std::string           bytes = os.str();
+
+	MemoryStreamBuf buf( reinterpret_cast< const unsigned char * >( bytes.data() ), bytes.size() );
+	std::iostream   stream( &buf );
+	Pkg             reader( stream );
+	reader.ParseVersion();
+	Header hdr = reader.ParseHeader();
+	REQUIRE( hdr.ItemCount() == 1 );
+	REQUIRE( bytes.substr( hdr.Get( 0 )->Offset(), hdr.Get( 0 )->Length() ) == "data" );
+}
+
+TEST_CASE( "EmitHeader writes constexpr item table" )
+{
+	std::array< char, 4 > file_data = {'d', 'a', 't', 'a'};
+	memstream< char >     file_stream( file_data.data(), file_data.size() );
+	std::stringstream     os( std::ios::in | std::ios::out | std::ios::binary );
+	Pkg                   pkg( os );
+	pkg.Add( "test.txt", static_cast< uint32_t >( file_data.size() ), file_stream );
+	pkg.Write();
+	std::string           bytes = os.str();
+	std::ostringstream    header;
+	EmitHeader( header, "assets", pkg.HeaderMut(), bytes.size() );
+	std::string expected_item = "{ \"test.txt\", " + std::to_string( pkg.Get( 0 )->Offset() ) + "u, 4u }";
+	REQUIRE( header.str().find( expected_item ) != std::string::npos );
+	REQUIRE( header.str().find( "extern \"C\" const unsigned char assets_data[];" ) != std::string::npos );
+	REQUIRE( header.str().find( "constexpr BinPkg::EmbeddedPkg assets( assets_data, " ) != std::string::npos );
+}
+
+TEST_CASE( "EmitCpp defines package bytes with external linkage" )
+{
+	const char         data[] = {0x00, 0x7F};
+	std::ostringstream source;
+	EmitCpp( source, "assets", data, sizeof( data ) );
+	REQUIRE( source.str().find( "extern \"C\" alignas( 16 ) const unsigned char assets_data[] = {\n\t0x00, 0x7f,\n};" ) != std::string::npos );
+}
+
+TEST_CASE( "Reader Find returns index of named item" )
+{
+	WriteTestPackage( "reader_find.binpkg", { "first", "second" } );
+	Reader reader( "reader_find.binpkg" );
+	REQUIRE( reader.ItemCount() == 2 );
+	REQUIRE( reader.Find( "1" ) == 1 );
+	REQUIRE( reader.Find( "2" ) == -1 );
+}
+
+TEST_CASE( "Reader Read returns range within item" )
+{
+	WriteTestPackage( "reader_range.binpkg", { "first", "second" } );
+	Reader reader( "reader_range.binpkg" );
+	char   buf[16] = {0};
+	REQUIRE( reader.Read( 1, 2, buf, 3 ) == 3 );
+	REQUIRE( std::string( buf, 3 ) == "con" );
+	REQUIRE( reader.Read( 1, 4, buf, sizeof( buf ) ) == 2 );
+	REQUIRE( std::string( buf, 2 ) == "nd" );
+	REQUIRE( reader.Read( 1, 6, buf, sizeof( buf ) ) == 0 );
+}
+
+TEST_CASE( "Reader Read is safe from multiple threads" )
+{
+	std::vector< std::string > contents;
+
+	for ( int i = 0; i < 8; ++i )
+	{
+		contents.push_back( std::string( 10000 + i, static_cast< char >( 'a' + i ) ) );
+	}
+	WriteTestPackage( "reader_threads.binpkg", contents );
+	Reader                     reader( "reader_threads.binpkg" );
+	std::vector< std::thread > threads;
+	std::vector< int >         mismatches( contents.size(), 0 );
+
+	for ( int t = 0; t < static_cast< int >( contents.size() ); ++t )
+	{
+		threads.emplace_back( [&, t]()
+		{
+			std::vector< char > buf( contents[t].size() );
+
+			for ( int n = 0; n < 100; ++n )
+			{
+				size_t bytes_read = reader.Read( t, 0, buf.data(), buf.size() );
+				mismatches[t] += ( std::string( buf.data(), bytes_read ) != contents[t] );
+			}
+		} );
+	}
+
+	for ( auto & thread : threads )
+	{
+		thread.join();
+	}
+	REQUIRE( mismatches == std::vector< int >( contents.size(), 0 ) );
+}
+
+TEST_CASE( "Reader reads packages embedded in memory" )
+{
+	WriteTestPackage( "reader_memory.binpkg", { "first", "second" } );
+	std::ifstream file( "reader_memory.binpkg", std::ios::binary );
+	std::string   bytes( ( std::istreambuf_iterator< char >( file ) ), std::istreambuf_iterator< char >() );
+	Reader        reader( reinterpret_cast< const unsigned char * >( bytes.data() ), bytes.size() );
+	char          buf[16] = {0};
+	REQUIRE( reader.Read( reader.Find( "0" ), 0, buf, sizeof( buf ) ) == 5 );
+	REQUIRE( std::string( buf, 5 ) == "first" );
+}
+
+TEST_CASE( "ItemCache Get counts hits and misses" )
+{
+	WriteTestPackage( "cache_hits.binpkg", { "first", "second" } );
+	Reader    reader( "cache_hits.binpkg" );
+	ItemCache cache( reader, 1024, 2 );
+	REQUIRE( *cache.Get( 1 ) == std::vector< char >{ 's', 'e', 'c', 'o', 'n', 'd' } );
+	REQUIRE( cache.Get( 1 ) == cache.Get( 1 ) );
+	ItemCache::Stats stats = cache.GetStats();
+	REQUIRE( stats.Hits == 2 );
+	REQUIRE( stats.Misses == 1 );
+	REQUIRE( cache.Size() == 6 );
+}
+
+TEST_CASE( "ItemCache evicts least recently used item when over budget" )
+{
+	WriteTestPackage( "cache_evict.binpkg", { "aaaa", "bbbb", "cccc" } );
+	Reader    reader( "cache_evict.binpkg" );
+	ItemCache cache( reader, 8, 1 );
+	cache.Get( 0 );
+	cache.Get( 1 );
+	cache.Get( 0 );
+	ItemCache::Buffer evicted = cache.Get( 1 );
+	cache.Get( 2 );
+	REQUIRE( cache.GetStats().Evictions == 1 );
+	REQUIRE( cache.Size() == 8 );
+	cache.Get( 0 );
+	REQUIRE( cache.GetStats().Misses == 4 );
+	REQUIRE( std::string( evicted->begin(), evicted->end() ) == "bbbb" );
+}
+
+TEST_CASE( "Reader Prefetch and Drop leave item data intact" )
+{
+	WriteTestPackage( "reader_advise.binpkg", { "first", "second" } );
+	std::ifstream file( "reader_advise.binpkg", std::ios::binary );
+	std::string   bytes( ( std::istreambuf_iterator< char >( file ) ), std::istreambuf_iterator< char >() );
+	Reader        file_reader( "reader_advise.binpkg" );
+	Reader        memory_reader( reinterpret_cast< const unsigned char * >( bytes.data() ), bytes.size() );
+
+	for ( const Reader * reader : { &file_reader, &memory_reader } )
+	{
+		char buf[16] = {0};
+		reader->Prefetch( { 0, 1 } );
+		reader->WillNeed( "1" );
+		reader->Drop( { 0 } );
+		reader->DontNeed( "missing" );
+		REQUIRE( reader->Read( 1, 0, buf, sizeof( buf ) ) == 6 );
+		REQUIRE( std::string( buf, 6 ) == "second" );
+	}
+}
+
+TEST_CASE( "Overlay later packages shadow earlier ones" )
+{
+	WriteTestPackage( "overlay_base.binpkg", { "base0", "base1" } );
+	WriteTestPackage( "overlay_patch.binpkg", { "patch0" } );
+	Overlay overlay( { "overlay_base.binpkg", "overlay_patch.binpkg" } );
+	char    buf[16] = {0};
+	REQUIRE( overlay.ItemCount() == 2 );
+	REQUIRE( overlay.Find( "0" ) == 0 );
+	REQUIRE( overlay.Read( overlay.Find( "0" ), 0, buf, sizeof( buf ) ) == 6 );
+	REQUIRE( std::string( buf, 6 ) == "patch0" );
+	REQUIRE( overlay.Read( overlay.Find( "1" ), 0, buf, sizeof( buf ) ) == 5 );
+	REQUIRE( std::string( buf, 5 ) == "base1" );
+	REQUIRE( overlay.Get( 0 )->Length() == 6 );
+}
+
+TEST_CASE( "Apply rebuilds new package from old package and Diff patch" )
+{
+	std::string large_old;
+
+	for ( int i = 0; i < 20000; ++i )
+	{
+		large_old += std::to_string( i * 7919 ) + ",";
+	}
+	std::string large_new = large_old;
+	large_new.insert( large_new.size() / 2, "inserted" );
+	WriteTestPackage( "delta_old.binpkg", { "unchanged", large_old, "removed" } );
+	WriteTestPackage( "delta_new.binpkg", { "unchanged", large_new, "added" } );
+	{
+		Reader       old_pkg( "delta_old.binpkg" );
+		Reader       new_pkg( "delta_new.binpkg" );
+		std::fstream patch( "delta.patch", std::ios::out | std::ios::binary );
+		Diff( old_pkg, new_pkg, patch );
+	}
+	Reader old_pkg( "delta_old.binpkg" );
+	Reader patch( "delta.patch" );
+	Apply( old_pkg, patch, "delta_applied.binpkg" );
+
+	std::ifstream expected_file( "delta_new.binpkg", std::ios::binary );
+	std::ifstream actual_file( "delta_applied.binpkg", std::ios::binary );
+	std::string   expected( ( std::istreambuf_iterator< char >( expected_file ) ), std::istreambuf_iterator< char >() );
+	std::string   actual( ( std::istreambuf_iterator< char >( actual_file ) ), std::istreambuf_iterator< char >() );
+	REQUIRE( actual == expected );
+	// Only the changed chunk of the large item should be stored in the patch.
+	REQUIRE( patch.Get( 1 )->Length() < large_new.size() / 4 );
+	REQUIRE( patch.Get( 0 )->Length() == 13 );
+}
+
+TEST_CASE( "Apply throws when the old package is not the one the patch was made from" )
+{
+	WriteTestPackage( "delta_base.binpkg", { "base0", "base1" } );
+	WriteTestPackage( "delta_other.binpkg", { "BASE0", "BASE1" } );
+	WriteTestPackage( "delta_base_new.binpkg", { "base0", "changed" } );
+	{
+		Reader       old_pkg( "delta_base.binpkg" );
+		Reader       new_pkg( "delta_base_new.binpkg" );
+		std::fstream patch( "delta_base.patch", std::ios::out | std::ios::binary );
+		Diff( old_pkg, new_pkg, patch );
+	}
+	Reader other_pkg( "delta_other.binpkg" );
+	Reader patch( "delta_base.patch" );
+	REQUIRE_THROWS( Apply( other_pkg, patch, "delta_base_applied.binpkg" ) );
+	REQUIRE_FALSE( std::ifstream( "delta_base_applied.binpkg" ).good() );
+}
+
+TEST_CASE( "Apply can replace the old package in place" )
+{
+	WriteTestPackage( "delta_inplace.binpkg", { "unchanged", "before" } );
+	WriteTestPackage( "delta_inplace_new.binpkg", { "unchanged", "after", "added" } );
+	{
+		Reader       old_pkg( "delta_inplace.binpkg" );
+		Reader       new_pkg( "delta_inplace_new.binpkg" );
+		std::fstream patch( "delta_inplace.patch", std::ios::out | std::ios::binary );
+		Diff( old_pkg, new_pkg, patch );
+	}
+	{
+		Reader old_pkg( "delta_inplace.binpkg" );
+		Reader patch( "delta_inplace.patch" );
+		Apply( old_pkg, patch, "delta_inplace.binpkg" );
+	}
+
+	std::ifstream expected_file( "delta_inplace_new.binpkg", std::ios::binary );
+	std::ifstream actual_file( "delta_inplace.binpkg", std::ios::binary );
+	std::string   expected( ( std::istreambuf_iterator< char >( expected_file ) ), std::istreambuf_iterator< char >() );
+	std::string   actual( ( std::istreambuf_iterator< char >( actual_file ) ), std::istreambuf_iterator< char >() );
+	REQUIRE( actual == expected );
+	REQUIRE_FALSE( std::ifstream( "delta_inplace.binpkg.tmp" ).good() );
+}
+
+TEST_CASE( "Repack reuses items whose source file is unchanged" )
+{
+	std::ofstream( "repack_a.txt", std::ios::binary ) << "first";
+	std::ofstream( "repack_b.txt", std::ios::binary ) << "second";
+	std::vector< RepackFile > files = { { "repack_a.txt", "a" }, { "repack_b.txt", "b" } };
+	RepackStats               stats = Repack( files, nullptr, "repack_1.binpkg" );
+	REQUIRE( stats.Packed == 2 );
+
+	std::ofstream( "repack_b.txt", std::ios::binary ) << "changed";
+	Reader previous( "repack_1.binpkg" );
+	REQUIRE( ReadSources( previous ).size() == 2 );
+	stats = Repack( files, &previous, "repack_2.binpkg" );
+	REQUIRE( stats.Reused == 1 );
+	REQUIRE( stats.Packed == 1 );
+
+	Reader repacked( "repack_2.binpkg" );
+	char   buf[16] = {0};
+	REQUIRE( repacked.Read( repacked.Find( "a" ), 0, buf, sizeof( buf ) ) == 5 );
+	REQUIRE( std::string( buf, 5 ) == "first" );
+	REQUIRE( repacked.Read( repacked.Find( "b" ), 0, buf, sizeof( buf ) ) == 7 );
+	REQUIRE( std::string( buf, 7 ) == "changed" );
+}
+
+TEST_CASE( "Repack throws when the package would exceed 4 GiB" )
+{
+	// Sparse files, since only their sizes are needed before Repack gives up.
+	for ( const char * path : { "repack_big1.bin", "repack_big2.bin" } )
+	{
+		std::ofstream big( path, std::ios::binary );
+		big.seekp( 3ll * 1024 * 1024 * 1024 );
+		big.put( 'x' );
+	}
+	std::ofstream( "repack_small.txt", std::ios::binary ) << "small";
+	std::vector< RepackFile > files = { { "repack_big1.bin", "big1" }, { "repack_big2.bin", "big2" }, { "repack_small.txt", "small" } };
+	REQUIRE_THROWS( Repack( files, nullptr, "repack_big.binpkg" ) );
+	std::remove( "repack_big1.bin" );
+	std::remove( "repack_big2.bin" );
+}
+
+TEST_CASE( "Repack with hash reuses items whose contents are unchanged" )
+{
+	std::ofstream( "repack_hash.txt", std::ios::binary ) << "contents";
+	std::vector< RepackFile > files = { { "repack_hash.txt", "hash" } };
+	Repack( files, nullptr, "repack_hash_1.binpkg", true );
+	Reader previous( "repack_hash_1.binpkg" );
+	REQUIRE( ReadSources( previous )[0].Hash != 0 );
+
+	// Rewrite identical contents, as a fresh checkout would.
+	std::ofstream( "repack_hash.txt", std::ios::binary ) << "contents";
+	RepackStats stats = Repack( files, &previous, "repack_hash_2.binpkg", true );
+	REQUIRE( stats.Reused == 1 );
+}
+
+TEST_CASE( "Reader reads items across volumes written by Split" )
+{
+	std::ofstream( "split_a.txt", std::ios::binary ) << "aaaaaaaa";
+	std::ofstream( "split_b.txt", std::ios::binary ) << "bbbbbbb";
+	std::ofstream( "split_c.txt", std::ios::binary ) << "cc";
+	std::vector< RepackFile > files = { { "split_a.txt", "a" }, { "split_b.txt", "b" }, { "split_c.txt", "c" } };
+	Split( files, { "split.binpkg", "split.binpkg.1", "split.binpkg.2" }, 0 );
+
+	Reader reader( "split.binpkg" );
+	char   buf[16] = {0};
+	REQUIRE( reader.Find( "c" ) == 2 );
+	REQUIRE( reader.Read( reader.Find( "a" ), 0, buf, sizeof( buf ) ) == 8 );
+	REQUIRE( std::string( buf, 8 ) == "aaaaaaaa" );
+	REQUIRE( reader.Read( reader.Find( "b" ), 3, buf, sizeof( buf ) ) == 4 );
+	REQUIRE( std::string( buf, 4 ) == "bbbb" );
+	REQUIRE( reader.Read( reader.Find( "c" ), 0, buf, sizeof( buf ) ) == 2 );
+	REQUIRE( std::string( buf, 2 ) == "cc" );
+
+	// The other volumes are not in memory, so the package must not be read from there.
+	std::ifstream is( "split.binpkg", std::ios::binary );
+	std::string   bytes( ( std::istreambuf_iterator< char >( is ) ), std::istreambuf_iterator< char >() );
+	REQUIRE_THROWS( Reader( reinterpret_cast< const unsigned char * >( bytes.data() ), bytes.size() ) );
+}
+
+TEST_CASE( "Reader throws when a volume is missing" )
+{
+	std::ofstream( "split_a.txt", std::ios::binary ) << "aaaaaaaa";
+	std::ofstream( "split_b.txt", std::ios::binary ) << "bbbbbbb";
+	std::vector< RepackFile > files = { { "split_a.txt", "a" }, { "split_b.txt", "b" } };
+	Split( files, { "split_missing.binpkg", "split_missing.binpkg.1" }, 0 );
+	std::remove( "split_missing.binpkg.1" );
+	REQUIRE_THROWS( Reader( "split_missing.binpkg" ) );
+}
+
+TEST_CASE( "Split throws when an item does not fit on any volume" )
+{
+	std::ofstream( "split_large.txt", std::ios::binary ) << std::string( 100, 'x' );
+	std::vector< RepackFile > files = { { "split_large.txt", "large" } };
+	REQUIRE_THROWS( Split( files, { "split_small.binpkg", "split_small.binpkg.1" }, 64 ) );
+}
+
+TEST_CASE( "PackBatch writes every package including shared files" )
+{
+	std::ofstream( "batch_shared.txt", std::ios::binary ) << std::string( 3 * 1024 * 1024 + 7, 's' );
+	std::ofstream( "batch_own.txt", std::ios::binary ) << "own";
+	std::vector< BatchPackage > packages = {
+		{ "batch_1.binpkg", { { "batch_shared.txt", "shared" }, { "batch_own.txt", "own" } } },
+		{ "batch_2.binpkg", { { "batch_own.txt", "renamed" }, { "batch_shared.txt", "shared" } } },
+		{ "batch_3.binpkg", {} },
+	};
+	PackBatch( packages, 2 );
+
+	Reader              first( "batch_1.binpkg" );
+	Reader              second( "batch_2.binpkg" );
+	Reader              third( "batch_3.binpkg" );
+	std::vector< char > buf( 4 * 1024 * 1024 );
+	REQUIRE( third.ItemCount() == 0 );
+	REQUIRE( second.Read( second.Find( "renamed" ), 0, buf.data(), buf.size() ) == 3 );
+	REQUIRE( std::string( buf.data(), 3 ) == "own" );
+
+	for ( const Reader * reader : { &first, &second } )
+	{
+		size_t bytes_read = reader->Read( reader->Find( "shared" ), 0, buf.data(), buf.size() );
+		REQUIRE( std::string( buf.data(), bytes_read ) == std::string( 3 * 1024 * 1024 + 7, 's' ) );
+	}
+}
+
+TEST_CASE( "PackBatch throws when two packages share a path" )
+{
+	std::ofstream( "batch_own.txt", std::ios::binary ) << "own";
+	std::vector< BatchPackage > packages = {
+		{ "batch_twice.binpkg", { { "batch_own.txt", "own" } } },
+		{ "batch_twice.binpkg", { { "batch_own.txt", "own" } } },
+	};
+	REQUIRE_THROWS( PackBatch( packages, 1 ) );
+}
+
+TEST_CASE( "PackBatch leaves existing packages untouched when an input is missing" )
+{
+	std::ofstream( "batch_own.txt", std::ios::binary ) << "own";
+	std::remove( "batch_missing.txt" );
+	std::vector< BatchPackage > good = { { "batch_keep.binpkg", { { "batch_own.txt", "own" } } } };
+	PackBatch( good, 1 );
+	std::ifstream before_file( "batch_keep.binpkg", std::ios::binary );
+	std::string   before( ( std::istreambuf_iterator< char >( before_file ) ), std::istreambuf_iterator< char >() );
+
+	std::vector< BatchPackage > packages = {
+		{ "batch_keep.binpkg", { { "batch_own.txt", "renamed" } } },
+		{ "batch_broken.binpkg", { { "batch_own.txt", "own" }, { "batch_missing.txt", "missing" } } },
+	};
+	REQUIRE_THROWS( PackBatch( packages, 1 ) );
+
+	std::ifstream after_file( "batch_keep.binpkg", std::ios::binary );
+	std::string   after( ( std::istreambuf_iterator< char >( after_file ) ), std::istreambuf_iterator< char >() );
+	REQUIRE( after == before );
+	REQUIRE_FALSE( std::ifstream( "batch_broken.binpkg" ).good() );
+}
+
+TEST_CASE( "PackBatch throws when a package is also an input" )
+{
+	std::ofstream( "batch_own.txt", std::ios::binary ) << "own";
+	std::vector< BatchPackage > packages = {
+		{ "batch_input.binpkg", { { "batch_own.txt", "own" } } },
+		{ "batch_nested.binpkg", { { "batch_input.binpkg", "nested" } } },
+	};
+	REQUIRE_THROWS( PackBatch( packages, 1 ) );
+}